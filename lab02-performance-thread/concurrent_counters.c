@@ -0,0 +1,110 @@
+#include "performance.h"
+#include "shared_counter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define N 1000 // max number of threads
+#define M 10000 // number of iterations per thread
+#define V 1 // value added to the balance by each thread at each iteration
+
+/*
+ * Benchmark for the correct shared counters of shared_counter.c: each
+ * implementation is run with 1, 2, 4, ... and finally n threads, each
+ * adding m times v. For every run we report the throughput (adds per
+ * second) and whether the final value matches n*m*v, i.e., whether
+ * any update got lost like in concurrent_threads.c.
+ *
+ * Usage: concurrent_counters [<n> [<m> [<v> [<counter name>]]]]
+ */
+
+int n = N, m = M, v = V;
+
+const shared_counter_ops_t* ops;
+void* counter;
+pthread_barrier_t start_barrier;
+
+void* thread_work(void *arg) {
+	int thread_idx = (int)(long)arg;
+	int i;
+
+	// wait until all threads exist, so that creation is not timed
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < m; i++)
+		ops->add(counter, thread_idx, v);
+	return NULL;
+}
+
+void run(int num_threads) {
+	counter = ops->create(num_threads);
+	if (counter == NULL) {
+		fprintf(stderr, "Cannot allocate the %s counter\n", ops->name);
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+	pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, thread_work, (void*)(long)i) != 0) {
+			fprintf(stderr, "Can't create a new thread, error %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	timer t;
+	begin(&t);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	end(&t);
+
+	unsigned long int value = ops->read(counter);
+	unsigned long int expected_value = (unsigned long int)num_threads*m*v;
+	double ops_per_sec = (double)num_threads * m / (get_nanoseconds(&t) / 1e9);
+	printf("%-10s %7d %15.0f %15lu %15lu  %s\n", ops->name, num_threads, ops_per_sec,
+			value, expected_value, value == expected_value ? "ok" : "LOST UPDATES");
+
+	pthread_barrier_destroy(&start_barrier);
+	ops->destroy(counter);
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) n = atoi(argv[1]);
+	if (argc > 2) m = atoi(argv[2]);
+	if (argc > 3) v = atoi(argv[3]);
+	const char* selected = (argc > 4) ? argv[4] : NULL;
+
+	int i;
+	if (selected) {
+		// a typo in the name must not look like a successful (empty) run
+		for (i = 0; SHARED_COUNTERS[i] != NULL; i++)
+			if (!strcmp(selected, SHARED_COUNTERS[i]->name)) break;
+		if (SHARED_COUNTERS[i] == NULL) {
+			fprintf(stderr, "Unknown counter \"%s\", valid names are:", selected);
+			for (i = 0; SHARED_COUNTERS[i] != NULL; i++)
+				fprintf(stderr, " %s", SHARED_COUNTERS[i]->name);
+			fprintf(stderr, "\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%-10s %7s %15s %15s %15s  %s\n", "counter", "threads", "adds/sec", "value", "expected", "result");
+
+	for (i = 0; SHARED_COUNTERS[i] != NULL; i++) {
+		ops = SHARED_COUNTERS[i];
+		if (selected && strcmp(selected, ops->name)) continue;
+
+		int num_threads;
+		for (num_threads = 1; num_threads < n; num_threads *= 2)
+			run(num_threads);
+		run(n);
+	}
+
+	return EXIT_SUCCESS;
+}
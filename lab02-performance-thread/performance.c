@@ -1,5 +1,73 @@
 #include "performance.h"
-#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#ifdef PERF_TSC
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "PERF_TSC requires an x86 CPU with an invariant TSC"
+#endif
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#define TSC_CALIBRATION_NS  20000000    // spin for 20 ms against CLOCK_MONOTONIC
+
+static double ns_per_cycle;
+
+static unsigned long int monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Executed before main(): checks CPUID.80000007H:EDX[8] (invariant TSC,
+ * i.e. the counter ticks at a constant rate regardless of frequency
+ * scaling and C-states) and measures how many nanoseconds a tick lasts.
+ */
+__attribute__((constructor))
+static void calibrate_tsc(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+		fprintf(stderr, "[WARNING] This CPU does not report an invariant TSC: timings may drift\n");
+
+	unsigned long int ns_start = monotonic_ns(), ns_now;
+	unsigned long long tsc_start = __rdtsc();
+	do {
+		ns_now = monotonic_ns();
+	} while (ns_now - ns_start < TSC_CALIBRATION_NS);
+	unsigned long long tsc_now = __rdtsc();
+
+	ns_per_cycle = (double)(ns_now - ns_start) / (tsc_now - tsc_start);
+}
+
+/*
+ * rdtsc is not serializing: the lfence before it waits for earlier
+ * instructions to complete, the one after it keeps the measured code
+ * from starting early. rdtscp already waits for earlier instructions,
+ * so end() only needs the trailing fence.
+ */
+void begin(timer* t) {
+	_mm_lfence();
+	t->begin = __rdtsc();
+	_mm_lfence();
+}
+
+void end(timer* t) {
+	unsigned int aux;
+	t->end = __rdtscp(&aux);
+	_mm_lfence();
+}
+
+unsigned long int get_nanoseconds(timer* t) {
+	return (unsigned long int)((t->end - t->begin) * ns_per_cycle + 0.5);
+}
+
+#else
 
 struct timespec diff(struct timespec start, struct timespec end)
 {
@@ -24,17 +92,202 @@ void end(timer* t) {
 }
 
 unsigned long int get_nanoseconds(timer* t) {
-	return t->elapsed.tv_sec * 1000000000 + t->elapsed.tv_nsec;
+	return t->elapsed.tv_sec * 1000000000UL + t->elapsed.tv_nsec;
 }
 
+#endif
+
+/*
+ * Round to the nearest unit. Results used to be truncated through an
+ * unsigned int, which wrapped around after ~71 minutes in microseconds.
+ */
 unsigned long int get_microseconds(timer* t) {
-	return (unsigned int)round(get_nanoseconds(t)/1000);
+	return (get_nanoseconds(t) + 500) / 1000;
 }
 
 unsigned long int get_milliseconds(timer* t) {
-	return (unsigned int)round(get_nanoseconds(t)/1000000);
+	return (get_nanoseconds(t) + 500000) / 1000000;
 }
 
 unsigned long int get_seconds(timer* t) {
-	return (unsigned int)round(get_nanoseconds(t)/1000000000);
+	return (get_nanoseconds(t) + 500000000) / 1000000000;
+}
+
+static const struct {
+	const char* name;
+	unsigned int type;
+	unsigned long long config;
+} perf_events[PERF_NUM_COUNTERS] = {
+	[PERF_CYCLES]           = { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS]     = { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CACHE_MISSES]     = { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[PERF_PAGE_FAULTS]      = { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/* glibc provides no wrapper for this system call */
+static int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+int perf_counters_open(perf_counters* c) {
+	int i, available = 0;
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size     = sizeof(attr);
+		attr.type     = perf_events[i].type;
+		attr.config   = perf_events[i].config;
+		attr.inherit  = 1;  // also count threads and children spawned later on
+
+		c->value[i] = 0;
+		c->fd[i] = perf_event_open(&attr, 0, -1, -1, 0);
+		if (c->fd[i] == -1 && (errno == EACCES || errno == EPERM)) {
+			// unprivileged users may only be allowed to count user-space events
+			attr.exclude_kernel = 1;
+			attr.exclude_hv     = 1;
+			c->fd[i] = perf_event_open(&attr, 0, -1, -1, 0);
+		}
+		if (c->fd[i] != -1) available++;
+	}
+	return available;
+}
+
+void perf_counters_close(perf_counters* c) {
+	int i;
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		if (c->fd[i] != -1) close(c->fd[i]);
+		c->fd[i] = -1;
+	}
+}
+
+int perf_counter_available(perf_counters* c, int counter) {
+	return c->fd[counter] != -1;
+}
+
+const char* perf_counter_name(int counter) {
+	return perf_events[counter].name;
+}
+
+static unsigned long long read_counter(int fd) {
+	unsigned long long value;
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return value;
+}
+
+/*
+ * Counters keep running from perf_counters_open() on, and a region is
+ * measured as the difference between two reads. Resetting them would
+ * not work: PERF_EVENT_IOC_RESET does not clear the counts that exited
+ * children have already handed back to the parent. Counters are read
+ * before the clock starts and after it stops, so that the read() calls
+ * are not part of the timed region.
+ */
+void begin_with_counters(timer* t, perf_counters* c) {
+	int i;
+	for (i = 0; i < PERF_NUM_COUNTERS; i++)
+		if (c->fd[i] != -1) c->start[i] = read_counter(c->fd[i]);
+	begin(t);
+}
+
+void end_with_counters(timer* t, perf_counters* c) {
+	end(t);
+	int i;
+	for (i = 0; i < PERF_NUM_COUNTERS; i++)
+		c->value[i] = (c->fd[i] != -1) ? read_counter(c->fd[i]) - c->start[i] : 0;
+}
+
+/*
+ * Bucket layout: index i < HISTOGRAM_SUB_BUCKETS holds exactly the
+ * value i. Above that, a value whose most significant bit is b lands
+ * in group g = b - HISTOGRAM_SUB_BITS + 1, and the HISTOGRAM_SUB_BITS
+ * bits right below the MSB select the sub-bucket inside the group.
+ */
+static int bucket_index(unsigned long int v) {
+	if (v < HISTOGRAM_SUB_BUCKETS)
+		return (int)v;
+	int msb = 63 - __builtin_clzl(v);
+	int group = msb - HISTOGRAM_SUB_BITS + 1;
+	int sub = (int)(v >> (group - 1)) - HISTOGRAM_SUB_BUCKETS;
+	return group * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// highest value that maps onto bucket i
+static unsigned long int bucket_upper_bound(int i) {
+	int group = i / HISTOGRAM_SUB_BUCKETS;
+	int sub = i % HISTOGRAM_SUB_BUCKETS;
+	if (group == 0)
+		return (unsigned long int)sub;
+	unsigned long int lower = (unsigned long int)(HISTOGRAM_SUB_BUCKETS + sub) << (group - 1);
+	return lower + ((1UL << (group - 1)) - 1);
+}
+
+void histogram_init(histogram* h) {
+	memset(h, 0, sizeof(histogram));
+	h->min = ~0UL;
+}
+
+void histogram_record(histogram* h, unsigned long int ns) {
+	h->buckets[bucket_index(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if (ns < h->min) h->min = ns;
+	if (ns > h->max) h->max = ns;
+}
+
+void histogram_record_timer(histogram* h, timer* t) {
+	histogram_record(h, get_nanoseconds(t));
+}
+
+void histogram_merge(histogram* dst, const histogram* src) {
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+double histogram_mean(const histogram* h) {
+	return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+/*
+ * Smallest recorded value v such that at least p percent of the
+ * samples are <= v, reported as the upper bound of its bucket (clamped
+ * to the observed min/max so that p0 and p100 are exact).
+ */
+unsigned long int histogram_percentile(const histogram* h, double p) {
+	if (h->count == 0)
+		return 0;
+	unsigned long int rank = (unsigned long int)(p / 100.0 * h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > h->count) rank = h->count;
+
+	unsigned long int seen = 0;
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			unsigned long int v = bucket_upper_bound(i);
+			if (v > h->max) v = h->max;
+			if (v < h->min) v = h->min;
+			return v;
+		}
+	}
+	return h->max;
+}
+
+void histogram_print(FILE* f, const char* label, const histogram* h) {
+	if (h->count == 0) {
+		fprintf(f, "%s: no samples\n", label);
+		return;
+	}
+	fprintf(f, "%s: %lu samples, min %.3f, mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p999 %.3f, max %.3f (us)\n",
+			label, h->count, h->min / 1000.0, histogram_mean(h) / 1000.0,
+			histogram_percentile(h, 50.0) / 1000.0, histogram_percentile(h, 90.0) / 1000.0,
+			histogram_percentile(h, 99.0) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+			h->max / 1000.0);
 }
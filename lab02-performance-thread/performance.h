@@ -1,13 +1,30 @@
 #ifndef __PERFORMANCE__
 #define __PERFORMANCE__
 
+#include <stdio.h>
 #include <time.h>       /* time */
 
+/*
+ * Two timer backends are available and chosen at compile time:
+ * - default: clock_gettime(CLOCK_MONOTONIC), a vDSO call costing a few
+ *   tens of nanoseconds per read;
+ * - PERF_TSC (build with `make TIMER=tsc`): the x86 invariant time stamp
+ *   counter read with serializing rdtsc/rdtscp, calibrated against
+ *   CLOCK_MONOTONIC when the program starts. Use it to time hot paths
+ *   that only last a few hundred cycles.
+ */
+#ifdef PERF_TSC
+typedef struct {
+	unsigned long long begin;
+	unsigned long long end;
+} timer;
+#else
 typedef struct {
 	struct timespec begin;
 	struct timespec end;
 	struct timespec elapsed;
 } timer;
+#endif
 
 void begin(timer* t);
 void end(timer* t);
@@ -16,4 +33,68 @@ unsigned long int get_milliseconds(timer* t);
 unsigned long int get_microseconds(timer* t);
 unsigned long int get_nanoseconds(timer* t);
 
+/*
+ * Optional event counters sampled through perf_event_open(2) around a
+ * timed region. Counters follow the calling thread and, since they are
+ * opened with the inherit flag, every thread and child process created
+ * after perf_counters_open(): the counts of a forked child are added
+ * to the parent's ones when the child exits.
+ *
+ * Counters the kernel refuses to open (no PMU in a VM, restrictive
+ * /proc/sys/kernel/perf_event_paranoid, ...) are simply marked as not
+ * available: use perf_counter_available() before trusting a value.
+ */
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_CONTEXT_SWITCHES,
+	PERF_PAGE_FAULTS,
+	PERF_NUM_COUNTERS
+};
+
+typedef struct {
+	int fd[PERF_NUM_COUNTERS];
+	unsigned long long start[PERF_NUM_COUNTERS];
+	unsigned long long value[PERF_NUM_COUNTERS];    // set by end_with_counters()
+} perf_counters;
+
+int perf_counters_open(perf_counters* c);   // returns how many counters are available
+void perf_counters_close(perf_counters* c);
+int perf_counter_available(perf_counters* c, int counter);
+const char* perf_counter_name(int counter);
+void begin_with_counters(timer* t, perf_counters* c);
+void end_with_counters(timer* t, perf_counters* c);
+
+/*
+ * Log-linear (HDR-style) latency histogram. Samples are nanoseconds:
+ * values below HISTOGRAM_SUB_BUCKETS are counted exactly, larger ones
+ * fall into one of HISTOGRAM_SUB_BUCKETS equal-width sub-buckets of
+ * their power of two, so the relative error never exceeds
+ * 1/HISTOGRAM_SUB_BUCKETS (~3%) over the whole 64-bit range.
+ *
+ * A histogram is not synchronized: each thread records into its own
+ * instance without any lock or atomic operation, and the main thread
+ * merges them with histogram_merge() after pthread_join().
+ */
+#define HISTOGRAM_SUB_BITS      5
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+	unsigned long int count;
+	unsigned long int min;
+	unsigned long int max;
+	unsigned long int sum;
+	unsigned long int buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+void histogram_init(histogram* h);
+void histogram_record(histogram* h, unsigned long int ns);
+void histogram_record_timer(histogram* h, timer* t);
+void histogram_merge(histogram* dst, const histogram* src);
+double histogram_mean(const histogram* h);
+unsigned long int histogram_percentile(const histogram* h, double p);
+void histogram_print(FILE* f, const char* label, const histogram* h);
+
 #endif
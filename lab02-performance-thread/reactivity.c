@@ -24,6 +24,9 @@ int main(int argc, char **argv)
 	int debug = (argc > 2) ? atoi(argv[2]) : 0;
 		
 	timer t;
+	histogram process_hist, thread_hist;
+	histogram_init(&process_hist);
+	histogram_init(&thread_hist);
 	int i;
 	unsigned long int sum;
 	
@@ -45,12 +48,14 @@ int main(int argc, char **argv)
 		}
 		end(&t);
 		sum += get_microseconds(&t);
+		histogram_record_timer(&process_hist, &t);
 		if (debug) {
 			printf("[%d] %lu us\n", i, get_microseconds(&t));
 		}
 	}
 	unsigned long int process_avg = sum / n;
 	printf("ok, average: %lu microseconds\n", process_avg);
+	histogram_print(stdout, "Process", &process_hist);
 	
 	// thread reactivity
 	printf("Thread reactivity, %d tests...", n);
@@ -66,6 +71,7 @@ int main(int argc, char **argv)
 		pthread_join(thread, NULL);
 		end(&t);
 		sum += get_microseconds(&t);
+		histogram_record_timer(&thread_hist, &t);
 		if (debug)
 			printf("[%d] %lu us\n", i, get_microseconds(&t));
 	}
@@ -73,6 +79,7 @@ int main(int argc, char **argv)
 	// compute statistics
 	unsigned long int thread_avg = sum / n;
 	printf("ok, average: %lu microseconds\n", thread_avg);
+	histogram_print(stdout, "Thread", &thread_hist);
 	
 	float speedup = (float)process_avg / thread_avg;
 	printf("Speedup: %.2f\n", speedup);
@@ -0,0 +1,233 @@
+#include "shared_counter.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE      64  // bytes
+#define NUM_STRIPES     64  // cells of the striped counter
+#define SPIN_TRIES      100 // failed polls before yielding the CPU
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause()
+#else
+#define cpu_relax()     do { } while (0)
+#endif
+
+static void* aligned_zalloc(size_t size) {
+	size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	void* p = aligned_alloc(CACHE_LINE, size);
+	if (p != NULL) memset(p, 0, size);
+	return p;
+}
+
+/*
+ * Spin-waiting threads yield after a while: with more threads than
+ * CPUs the lock holder may be preempted, and burning the rest of our
+ * time slice would only delay it further.
+ */
+static void backoff(int* tries) {
+	if (++(*tries) < SPIN_TRIES) {
+		cpu_relax();
+	} else {
+		*tries = 0;
+		sched_yield();
+	}
+}
+
+/*** Single atomic variable: one fetch_add per update ***/
+
+typedef struct atomic_counter_s {
+	atomic_ulong value;
+} atomic_counter_t;
+
+static void* atomic_create(int num_threads) {
+	return aligned_zalloc(sizeof(atomic_counter_t));
+}
+
+static void atomic_add(void* counter, int thread_idx, unsigned long int value) {
+	atomic_fetch_add_explicit(&((atomic_counter_t*)counter)->value, value, memory_order_relaxed);
+}
+
+static unsigned long int atomic_read(void* counter) {
+	return atomic_load(&((atomic_counter_t*)counter)->value);
+}
+
+/*** Plain variable protected by a pthread mutex ***/
+
+typedef struct mutex_counter_s {
+	pthread_mutex_t mutex;
+	unsigned long int value;
+} mutex_counter_t;
+
+static void* mutex_create(int num_threads) {
+	mutex_counter_t* c = aligned_zalloc(sizeof(mutex_counter_t));
+	if (c == NULL) return NULL;
+	pthread_mutex_init(&c->mutex, NULL);
+	return c;
+}
+
+static void mutex_add(void* counter, int thread_idx, unsigned long int value) {
+	mutex_counter_t* c = (mutex_counter_t*)counter;
+	pthread_mutex_lock(&c->mutex);
+	c->value += value;
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static unsigned long int mutex_read(void* counter) {
+	mutex_counter_t* c = (mutex_counter_t*)counter;
+	pthread_mutex_lock(&c->mutex);
+	unsigned long int value = c->value;
+	pthread_mutex_unlock(&c->mutex);
+	return value;
+}
+
+static void mutex_destroy(void* counter) {
+	pthread_mutex_destroy(&((mutex_counter_t*)counter)->mutex);
+	free(counter);
+}
+
+/*** Plain variable protected by a test-and-test-and-set spinlock ***/
+
+typedef struct spinlock_counter_s {
+	atomic_int locked;
+	unsigned long int value;
+} spinlock_counter_t;
+
+static void* spinlock_create(int num_threads) {
+	return aligned_zalloc(sizeof(spinlock_counter_t));
+}
+
+static void spinlock_add(void* counter, int thread_idx, unsigned long int value) {
+	spinlock_counter_t* c = (spinlock_counter_t*)counter;
+	int tries = 0;
+	while (1) {
+		// only try the (cache line stealing) exchange when the lock looks free
+		if (!atomic_load_explicit(&c->locked, memory_order_relaxed) &&
+				!atomic_exchange_explicit(&c->locked, 1, memory_order_acquire))
+			break;
+		backoff(&tries);
+	}
+	c->value += value;
+	atomic_store_explicit(&c->locked, 0, memory_order_release);
+}
+
+static unsigned long int spinlock_read(void* counter) {
+	spinlock_counter_t* c = (spinlock_counter_t*)counter;
+	spinlock_add(c, 0, 0);
+	return c->value;
+}
+
+/*** Striped counter: threads update one of NUM_STRIPES padded cells ***/
+
+typedef struct stripe_s {
+	atomic_ulong value;
+} __attribute__((aligned(CACHE_LINE))) stripe_t;
+
+static void* striped_create(int num_threads) {
+	return aligned_zalloc(NUM_STRIPES * sizeof(stripe_t));
+}
+
+static void striped_add(void* counter, int thread_idx, unsigned long int value) {
+	stripe_t* stripes = (stripe_t*)counter;
+	atomic_fetch_add_explicit(&stripes[thread_idx % NUM_STRIPES].value, value, memory_order_relaxed);
+}
+
+// reads are O(NUM_STRIPES): the price paid for uncontended updates
+static unsigned long int striped_read(void* counter) {
+	stripe_t* stripes = (stripe_t*)counter;
+	unsigned long int sum = 0;
+	int i;
+	for (i = 0; i < NUM_STRIPES; i++)
+		sum += atomic_load(&stripes[i].value);
+	return sum;
+}
+
+/*
+ * Flat combining: each thread publishes its request in its own slot,
+ * and whichever thread manages to grab the combiner lock applies all
+ * the pending requests at once to a plain variable. The counter's
+ * cache line only moves between cores once per combining pass instead
+ * of once per update.
+ */
+
+typedef struct fc_slot_s {
+	atomic_int pending;
+	unsigned long int value;
+} __attribute__((aligned(CACHE_LINE))) fc_slot_t;
+
+typedef struct combining_counter_s {
+	atomic_int combiner;
+	unsigned long int value;
+	int num_slots;
+	fc_slot_t* slots;
+} combining_counter_t;
+
+static void* combining_create(int num_threads) {
+	combining_counter_t* c = aligned_zalloc(sizeof(combining_counter_t));
+	if (c == NULL) return NULL;
+	c->num_slots = num_threads;
+	c->slots = aligned_zalloc(num_threads * sizeof(fc_slot_t));
+	if (c->slots == NULL) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void combine(combining_counter_t* c) {
+	int i;
+	for (i = 0; i < c->num_slots; i++) {
+		fc_slot_t* slot = &c->slots[i];
+		if (atomic_load_explicit(&slot->pending, memory_order_acquire)) {
+			c->value += slot->value;
+			atomic_store_explicit(&slot->pending, 0, memory_order_release);
+		}
+	}
+}
+
+static void combining_add(void* counter, int thread_idx, unsigned long int value) {
+	combining_counter_t* c = (combining_counter_t*)counter;
+	fc_slot_t* slot = &c->slots[thread_idx];
+
+	slot->value = value;
+	atomic_store_explicit(&slot->pending, 1, memory_order_release);
+
+	int tries = 0;
+	while (atomic_load_explicit(&slot->pending, memory_order_acquire)) {
+		if (!atomic_load_explicit(&c->combiner, memory_order_relaxed) &&
+				!atomic_exchange_explicit(&c->combiner, 1, memory_order_acquire)) {
+			combine(c);
+			atomic_store_explicit(&c->combiner, 0, memory_order_release);
+		} else {
+			backoff(&tries);
+		}
+	}
+}
+
+static unsigned long int combining_read(void* counter) {
+	combining_counter_t* c = (combining_counter_t*)counter;
+	int tries = 0;
+	while (atomic_exchange_explicit(&c->combiner, 1, memory_order_acquire))
+		backoff(&tries);
+	combine(c);
+	unsigned long int value = c->value;
+	atomic_store_explicit(&c->combiner, 0, memory_order_release);
+	return value;
+}
+
+static void combining_destroy(void* counter) {
+	free(((combining_counter_t*)counter)->slots);
+	free(counter);
+}
+
+const shared_counter_ops_t ATOMIC_COUNTER    = { "atomic",    atomic_create,    atomic_add,    atomic_read,    free };
+const shared_counter_ops_t MUTEX_COUNTER     = { "mutex",     mutex_create,     mutex_add,     mutex_read,     mutex_destroy };
+const shared_counter_ops_t SPINLOCK_COUNTER  = { "spinlock",  spinlock_create,  spinlock_add,  spinlock_read,  free };
+const shared_counter_ops_t STRIPED_COUNTER   = { "striped",   striped_create,   striped_add,   striped_read,   free };
+const shared_counter_ops_t COMBINING_COUNTER = { "combining", combining_create, combining_add, combining_read, combining_destroy };
+
+const shared_counter_ops_t* SHARED_COUNTERS[] = {
+	&ATOMIC_COUNTER, &MUTEX_COUNTER, &SPINLOCK_COUNTER, &STRIPED_COUNTER, &COMBINING_COUNTER, NULL
+};
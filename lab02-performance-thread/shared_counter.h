@@ -0,0 +1,28 @@
+#ifndef __SHARED_COUNTER__
+#define __SHARED_COUNTER__
+
+/*
+ * Correct alternatives to the racy `shared_variable += v` of
+ * concurrent_threads.c. Every implementation is used through the same
+ * table of operations: create() is told how many threads will use the
+ * counter and each thread passes its own index (0 .. num_threads-1) to
+ * add(), which some implementations use to spread the load.
+ */
+typedef struct shared_counter_ops_s {
+	const char* name;
+	void* (*create)(int num_threads);
+	void (*add)(void* counter, int thread_idx, unsigned long int value);
+	unsigned long int (*read)(void* counter);
+	void (*destroy)(void* counter);
+} shared_counter_ops_t;
+
+extern const shared_counter_ops_t ATOMIC_COUNTER;
+extern const shared_counter_ops_t MUTEX_COUNTER;
+extern const shared_counter_ops_t SPINLOCK_COUNTER;
+extern const shared_counter_ops_t STRIPED_COUNTER;
+extern const shared_counter_ops_t COMBINING_COUNTER;
+
+// NULL-terminated list of all the implementations above
+extern const shared_counter_ops_t* SHARED_COUNTERS[];
+
+#endif
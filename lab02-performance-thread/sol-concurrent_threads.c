@@ -1,5 +1,7 @@
+#include "performance.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <errno.h>
 
@@ -7,6 +9,8 @@
 #define M 10000 // number of iterations per thread
 #define V 1 // value added to the balance by each thread at each iteration
 
+#define CACHE_LINE 64 // bytes
+
 /*
  * Solving race conditions without any os-level synchronization
  * primitive can be achieved by preventing threads to access the same
@@ -22,8 +26,38 @@
  * For questions, send an email to aniello@dis.uniroma1.it
  */
 
+/*
+ * Distinct variables are not enough to avoid contention, though: the
+ * CPU keeps caches coherent one cache line (64 bytes) at a time, so
+ * eight neighbouring unsigned longs of shared_array live in the same
+ * line and every add by a thread invalidates the copy of its seven
+ * neighbours (false sharing). The program times four layouts:
+ * - packed:   the shared array described above;
+ * - padded:   each accumulator sits alone in its own cache line;
+ * - local:    like padded, but each thread allocates its own line, so
+ *             that on NUMA machines the first-touch policy places it
+ *             on the memory node the thread runs on;
+ * - register: the thread adds into a local variable, which the
+ *             compiler can keep in a register, and publishes the sum
+ *             into shared_array only once at the end.
+ * Pass the layout as fourth argument, or "all" (default) to compare.
+ */
+
+typedef enum { PACKED, PADDED, LOCAL, REGISTER, NUM_LAYOUTS } layout_t;
+
+static const char* LAYOUT_NAMES[NUM_LAYOUTS] = { "packed", "padded", "local", "register" };
+
+typedef struct padded_counter_s {
+	unsigned long int value;
+	char padding[CACHE_LINE - sizeof(unsigned long int)];
+} __attribute__((aligned(CACHE_LINE))) padded_counter_t;
+
 int n = N, m = M, v = V;
+layout_t layout;
 unsigned long int* shared_array;
+padded_counter_t* padded_array;
+padded_counter_t** local_counters;
+pthread_barrier_t start_barrier;
 
 void* thread_work(void *arg) {
 	/*
@@ -33,19 +67,61 @@ void* thread_work(void *arg) {
 	 */
 	int thread_idx = *((int*)arg);
 	int i;
-	for (i = 0; i < m; i++)
-		shared_array[thread_idx] += v;
+	padded_counter_t* counter = NULL;
+	if (layout == LOCAL) {
+		counter = aligned_alloc(CACHE_LINE, sizeof(padded_counter_t));
+		if (counter == NULL) {
+			fprintf(stderr, "Can't allocate the counter of thread %d\n", thread_idx);
+			exit(EXIT_FAILURE);
+		}
+		counter->value = 0; // first touch happens here, on this thread's node
+		local_counters[thread_idx] = counter;
+	}
+
+	/*
+	 * Wait until all the threads exist: otherwise each thread would be
+	 * done with its adds before the next one is even created, and the
+	 * threads would never run (and contend) at the same time.
+	 */
+	pthread_barrier_wait(&start_barrier);
+
+	if (layout == PACKED) {
+		for (i = 0; i < m; i++)
+			shared_array[thread_idx] += v;
+	} else if (layout == PADDED) {
+		for (i = 0; i < m; i++)
+			padded_array[thread_idx].value += v;
+	} else if (layout == LOCAL) {
+		for (i = 0; i < m; i++)
+			counter->value += v;
+	} else {
+		register unsigned long int sum = 0;
+		for (i = 0; i < m; i++)
+			sum += v;
+		shared_array[thread_idx] = sum;
+	}
 	return NULL;
 }
 
-int main(int argc, char **argv)
-{
-	if (argc > 1) n = atoi(argv[1]);
-	if (argc > 2) m = atoi(argv[2]);
-	if (argc > 3) v = atoi(argv[3]);
+/*
+ * Runs the whole experiment with the given layout and returns the
+ * elapsed time in microseconds, from the moment all the threads have
+ * been created and are released at once until the last one terminates.
+ */
+unsigned long int run(layout_t l) {
+	layout = l;
 	shared_array = (unsigned long int*)calloc(n, sizeof(unsigned long int));
+	padded_array = (padded_counter_t*)aligned_alloc(CACHE_LINE, n * sizeof(padded_counter_t));
+	local_counters = (padded_counter_t**)calloc(n, sizeof(padded_counter_t*));
+	if (shared_array == NULL || padded_array == NULL || local_counters == NULL) {
+		fprintf(stderr, "Can't allocate the counters for %d threads\n", n);
+		exit(EXIT_FAILURE);
+	}
+	memset(padded_array, 0, n * sizeof(padded_counter_t));
+	pthread_barrier_init(&start_barrier, NULL, n + 1);
+	timer t;
 	
-	printf("Going to start %d threads, each adding %d times %d to a shared data structure initialized to zero...", n, m, v); fflush(stdout);
+	printf("[%s] Going to start %d threads, each adding %d times %d to a shared data structure initialized to zero...", LAYOUT_NAMES[l], n, m, v); fflush(stdout);
 	pthread_t* threads = (pthread_t*)malloc(n * sizeof(pthread_t));
 	/*
 	 * We need to tell the i-th thread that....it is the i-th thread.
@@ -66,29 +142,77 @@ int main(int argc, char **argv)
 	}
 	printf("ok\n");
 	
+	// all the threads are waiting on the barrier: start the clock and release them
+	begin(&t);
+	pthread_barrier_wait(&start_barrier);
+
 	/*
 	 * When the i-th thread terminates, we get the sum of all its adds
 	 * (stored in shared_array[i]) and add it to computed_value
 	 * variable.
 	 */
-	printf("Waiting for the termination of all the %d threads...", n); fflush(stdout);
+	printf("[%s] Waiting for the termination of all the %d threads...", LAYOUT_NAMES[l], n); fflush(stdout);
 	unsigned long int computed_value = 0;
 	for (i = 0; i < n; i++) {
 		pthread_join(threads[i], NULL);
-		computed_value += shared_array[i];
+		if (l == PADDED)
+			computed_value += padded_array[i].value;
+		else if (l == LOCAL)
+			computed_value += local_counters[i]->value;
+		else
+			computed_value += shared_array[i];
 	}
+	end(&t);
 	printf("ok\n");
 	
 	
 	unsigned long int expected_value = (unsigned long int)n*m*v;
-	printf("The value computed on the array is %lu. It should have been %lu\n", computed_value, expected_value);
+	printf("[%s] The value computed is %lu. It should have been %lu\n", LAYOUT_NAMES[l], computed_value, expected_value);
 	if (expected_value > computed_value) {
 		unsigned long int lost_adds = (expected_value - computed_value) / v;
 		printf("Number of lost adds: %lu\n", lost_adds);
 	}
+	printf("[%s] It took %lu microseconds\n", LAYOUT_NAMES[l], get_microseconds(&t));
 	
+	for (i = 0; i < n; i++)
+		free(local_counters[i]);
+	free(local_counters);
+	free(padded_array);
 	free(shared_array);
 	free(threads);
 	free(thread_ids);
+	pthread_barrier_destroy(&start_barrier);
+	return get_microseconds(&t);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) n = atoi(argv[1]);
+	if (argc > 2) m = atoi(argv[2]);
+	if (argc > 3) v = atoi(argv[3]);
+
+	int l, selected = NUM_LAYOUTS; // all of them
+	if (argc > 4 && strcmp(argv[4], "all")) {
+		for (selected = 0; selected < NUM_LAYOUTS; selected++)
+			if (!strcmp(argv[4], LAYOUT_NAMES[selected])) break;
+		if (selected == NUM_LAYOUTS) {
+			fprintf(stderr, "Syntax: %s [<n> [<m> [<v> [packed|padded|local|register|all]]]]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (selected != NUM_LAYOUTS) {
+		run(selected);
+		return EXIT_SUCCESS;
+	}
+
+	unsigned long int elapsed[NUM_LAYOUTS];
+	for (l = 0; l < NUM_LAYOUTS; l++)
+		elapsed[l] = run(l);
+
+	printf("\nLayout     time (us)  speedup w.r.t. packed\n");
+	for (l = 0; l < NUM_LAYOUTS; l++)
+		printf("%-10s %9lu  %.2f\n", LAYOUT_NAMES[l], elapsed[l], elapsed[l] ? (double)elapsed[PACKED] / elapsed[l] : 0.0);
+
 	return EXIT_SUCCESS;
 }
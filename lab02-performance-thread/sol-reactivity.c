@@ -1,11 +1,19 @@
+#define _GNU_SOURCE     // clone()
 #include "performance.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <pthread.h>
  
+ 
 /*
  * La semantica di una fork() prevede che il processo figlio prosegua
  * da una copia della memoria del padre. I moderni sistemi operativi
@@ -34,25 +42,378 @@
  * dei valori di STEP utilizzati.
  */ 
 
+/*
+ * Sweep mode (`sol-reactivity sweep <N> [<csv file>]`) answers the
+ * questions above experimentally: for every buffer size in SWEEP_ITEMS,
+ * every STEP in SWEEP_STEPS and every creation mechanism in the table
+ * below it runs N trials and writes one CSV row per trial with the
+ * measured latency and page faults.
+ */
 
 #define ITEMS   (1 << 24)
 #define STEP    1024
+
+#define CHILD_FLAG      "--child"   // argv[1] of the image run by posix_spawn()
+#define CLONE_STACK     (64 * 1024)
+#define SPIN_LIMIT      10000       // polls before a spin-then-park waiter sleeps
+
+static const int SWEEP_ITEMS[] = { 1 << 18, 1 << 20, 1 << 22, 1 << 24 };
+static const int SWEEP_STEPS[] = { 1, 128, 256, 512, 1024, 2048, 4096 };
+
 int* global_buff = NULL;
+int items = ITEMS, step = STEP;
 
-void* thread_fun(void *arg) {
+extern char** environ;
+
+void touch_buffer() {
     int j;
-    for (j = 0; j < ITEMS; j += STEP) {
+    for (j = 0; j < items; j += step) {
         global_buff[j] = j;
-    }    
+    }
+}
+
+void* thread_fun(void *arg) {
+    touch_buffer();
 	return NULL;
 }
 
+/*
+ * Each mechanism creates an execution flow that writes on the buffer,
+ * waits for it to complete and returns: the caller times the whole.
+ */
+
+void run_fork() {
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "Can't fork, error %d\n", errno);
+		exit(EXIT_FAILURE);
+	} else if (pid == 0) {
+		touch_buffer();
+		free(global_buff);
+		_exit(EXIT_SUCCESS); // exit() would flush a copy of the parent's pending CSV rows
+	}
+	wait(0);
+}
+
+/*
+ * The vfork() child borrows the parent's address space (nothing is
+ * copied, the parent is suspended until the child exits), so its writes
+ * land in the parent's buffer just like a thread's would.
+ */
+void run_vfork() {
+	pid_t pid = vfork();
+	if (pid == -1) {
+		fprintf(stderr, "Can't vfork, error %d\n", errno);
+		exit(EXIT_FAILURE);
+	} else if (pid == 0) {
+		touch_buffer();
+		_exit(EXIT_SUCCESS);
+	}
+	wait(0);
+}
+
+/*
+ * posix_spawn() starts a new program image, which has no buffer to
+ * write on: it measures process creation plus exec, independently of
+ * the parent's memory footprint.
+ */
+void run_posix_spawn() {
+	char* child_argv[] = { "sol-reactivity", CHILD_FLAG, NULL };
+	pid_t pid;
+	int ret = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, child_argv, environ);
+	if (ret != 0) {
+		fprintf(stderr, "Can't posix_spawn, error %d\n", ret);
+		exit(EXIT_FAILURE);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+int clone_fun(void* arg) {
+	touch_buffer();
+	return 0;
+}
+
+/*
+ * clone() with CLONE_VM creates a process that shares the address space
+ * of its parent: no page table copy and no copy-on-write, but still a
+ * separate process to be reaped with waitpid().
+ */
+void run_clone() {
+	static char* stack = NULL;
+	if (stack == NULL) stack = malloc(CLONE_STACK);
+
+	pid_t pid = clone(clone_fun, stack + CLONE_STACK, CLONE_VM | SIGCHLD, NULL);
+	if (pid == -1) {
+		fprintf(stderr, "Can't clone, error %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+void run_pthread() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, thread_fun, NULL) != 0) {
+		fprintf(stderr, "Can't create a new thread, error %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	pthread_join(thread, NULL);
+}
+
+/*
+ * Pooled wakeup: a worker thread is created once and then handed one
+ * request at a time, so each trial only pays for the wakeup and the
+ * completion notification. This is what a thread-per-connection server
+ * would save per request by switching to a pool. Three handoffs are
+ * compared: a condition variable, a bare futex and spin-then-park.
+ */
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  pool_request = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  pool_done = PTHREAD_COND_INITIALIZER;
+int pool_pending = 0;
+pthread_t pool_thread;
+
+void* pool_worker(void* arg) {
+	while (1) {
+		pthread_mutex_lock(&pool_mutex);
+		while (!pool_pending)
+			pthread_cond_wait(&pool_request, &pool_mutex);
+		pthread_mutex_unlock(&pool_mutex);
+
+		thread_fun(NULL);
+
+		pthread_mutex_lock(&pool_mutex);
+		pool_pending = 0;
+		pthread_cond_signal(&pool_done);
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	return NULL;
+}
+
+void run_pool_condvar() {
+	static int started = 0;
+	if (!started) {
+		if (pthread_create(&pool_thread, NULL, pool_worker, NULL) != 0) {
+			fprintf(stderr, "Can't create the pool thread, error %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		started = 1;
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_pending = 1;
+	pthread_cond_signal(&pool_request);
+	while (pool_pending)
+		pthread_cond_wait(&pool_done, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * One-shot event with a single waiter, built directly on a futex:
+ * 0 = not signaled, 1 = signaled, 2 = the waiter is asleep in the
+ * kernel. The signaler only enters the kernel for state 2, and the
+ * waiter polls the word up to `spin` times before going to sleep.
+ */
+typedef struct event_s {
+	atomic_int state;
+} event_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause()
+#else
+#define cpu_relax()     do { } while (0)
+#endif
+
+void event_wait(event_t* e, int spin) {
+	int i;
+	for (i = 0; i < spin && atomic_load(&e->state) != 1; i++)
+		cpu_relax();
+
+	while (1) {
+		int s = atomic_load(&e->state);
+		if (s == 1) {
+			atomic_store(&e->state, 0);
+			return;
+		}
+		if (s == 0 && !atomic_compare_exchange_strong(&e->state, &s, 2))
+			continue;
+		syscall(SYS_futex, &e->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+	}
+}
+
+void event_signal(event_t* e) {
+	if (atomic_exchange(&e->state, 1) == 2)
+		syscall(SYS_futex, &e->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+typedef struct event_pool_s {
+	event_t request;
+	event_t done;
+	int spin;
+	int started;
+	pthread_t thread;
+} event_pool_t;
+
+event_pool_t futex_pool = { .spin = 0 };
+event_pool_t spin_pool = { .spin = SPIN_LIMIT };
+
+void* event_pool_worker(void* arg) {
+	event_pool_t* pool = (event_pool_t*)arg;
+	while (1) {
+		event_wait(&pool->request, pool->spin);
+		thread_fun(NULL);
+		event_signal(&pool->done);
+	}
+	return NULL;
+}
+
+void run_event_pool(event_pool_t* pool) {
+	if (!pool->started) {
+		if (pthread_create(&pool->thread, NULL, event_pool_worker, pool) != 0) {
+			fprintf(stderr, "Can't create the pool thread, error %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		pool->started = 1;
+	}
+	event_signal(&pool->request);
+	event_wait(&pool->done, pool->spin);
+}
+
+void run_pool_futex() {
+	run_event_pool(&futex_pool);
+}
+
+void run_pool_spin() {
+	run_event_pool(&spin_pool);
+}
+
+/*
+ * The page fault counter is inherited by the threads and processes a
+ * trial creates, and their counts are added to ours when they exit. The
+ * workers of the pools never exit, so their faults are never counted:
+ * for those mechanisms the CSV reports NA instead of a bogus zero.
+ */
+typedef struct mechanism_s {
+	const char* name;
+	void (*run)();
+	int counts_faults;
+} mechanism_t;
+
+enum { FORK, VFORK, POSIX_SPAWN, CLONE, PTHREAD_CREATE, POOL_CONDVAR, POOL_FUTEX, POOL_SPIN };
+
+static const mechanism_t MECHANISMS[] = {
+	[FORK]           = { "fork",           run_fork,         1 },
+	[VFORK]          = { "vfork",          run_vfork,        1 },
+	[POSIX_SPAWN]    = { "posix_spawn",    run_posix_spawn,  1 },
+	[CLONE]          = { "clone",          run_clone,        1 },
+	[PTHREAD_CREATE] = { "pthread_create", run_pthread,      1 },
+	[POOL_CONDVAR]   = { "pool_condvar",   run_pool_condvar, 0 },
+	[POOL_FUTEX]     = { "pool_futex",     run_pool_futex,   0 },
+	[POOL_SPIN]      = { "pool_spin",      run_pool_spin,    0 },
+};
+
+#define NUM_ELEMS(a)    (sizeof(a) / sizeof((a)[0]))
+
+perf_counters counters;
+
+/*
+ * Runs n trials of a mechanism, recording their latency in hist. Returns
+ * the total number of page faults (0 when the counter is not available).
+ * When csv is not NULL, one row per trial is appended to it.
+ */
+unsigned long long measure(const mechanism_t* m, int n, histogram* hist, int debug, FILE* csv) {
+	timer t;
+	unsigned long long faults = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		begin_with_counters(&t, &counters);
+		m->run();
+		end_with_counters(&t, &counters);
+		faults += counters.value[PERF_PAGE_FAULTS];
+		histogram_record_timer(hist, &t);
+		if (debug)
+			printf("[%d] %lu us\n", i, get_microseconds(&t));
+		if (csv && m->counts_faults)
+			fprintf(csv, "%s,%d,%lu,%d,%d,%lu,%llu\n", m->name, items, items * sizeof(int), step, i,
+					get_nanoseconds(&t), counters.value[PERF_PAGE_FAULTS]);
+		else if (csv)
+			fprintf(csv, "%s,%d,%lu,%d,%d,%lu,NA\n", m->name, items, items * sizeof(int), step, i,
+					get_nanoseconds(&t));
+	}
+	return faults;
+}
+
+void allocate_buffer() {
+	// allocate a large buffer of zeroed memory 
+	global_buff = (int*)calloc(items, sizeof(int));
+    if (global_buff == NULL) {
+        fprintf(stderr, "Cannot allocate memory!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void sweep(int n, FILE* csv) {
+	fprintf(csv, "mechanism,items,bytes,step,trial,nanoseconds,page_faults\n");
+
+	unsigned int i, j, k;
+	for (i = 0; i < NUM_ELEMS(SWEEP_ITEMS); i++) {
+		items = SWEEP_ITEMS[i];
+		allocate_buffer();
+
+		/* Touch every page once, so that all mechanisms start from a
+		 * parent whose buffer is actually backed by memory. */
+		step = 1;
+		touch_buffer();
+
+		for (j = 0; j < NUM_ELEMS(SWEEP_STEPS); j++) {
+			step = SWEEP_STEPS[j];
+			for (k = 0; k < NUM_ELEMS(MECHANISMS); k++) {
+				fprintf(stderr, "%d items, STEP %d, %s...\n", items, step, MECHANISMS[k].name);
+				histogram hist;
+				histogram_init(&hist);
+				measure(&MECHANISMS[k], n, &hist, 0, csv);
+			}
+		}
+		free(global_buff);
+	}
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
+	if (argc > 1 && !strcmp(argv[1], CHILD_FLAG))
+		return EXIT_SUCCESS; // started by run_posix_spawn()
+
+	int sweep_mode = (argc > 1 && !strcmp(argv[1], "sweep"));
+    if (argc < 2 || (sweep_mode && argc < 3)) {
 		fprintf(stderr, "Syntax: %s <N> [<debug>]\n", argv[0]);
+		fprintf(stderr, "        %s sweep <N> [<csv file>]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
+
+	/*
+	 * Count the page faults taken by each trial, so that the cost of
+	 * copy-on-write discussed above is measured rather than inferred.
+	 * Counters are inherited by forked children and created threads.
+	 */
+	perf_counters_open(&counters);
+	int faults_available = perf_counter_available(&counters, PERF_PAGE_FAULTS);
+	if (!faults_available)
+		fprintf(stderr, "[WARNING] Page-fault counter not available: %s\n", strerror(errno));
+
+	if (sweep_mode) {
+		int n = atoi(argv[2]);
+		FILE* csv = stdout;
+		if (argc > 3) {
+			csv = fopen(argv[3], "w");
+			if (csv == NULL) {
+				fprintf(stderr, "Cannot open %s: %s\n", argv[3], strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+		sweep(n, csv);
+		if (csv != stdout) fclose(csv);
+		perf_counters_close(&counters);
+		return EXIT_SUCCESS;
+	}
 	
 	// parse N from the command line
 	int n = atoi(argv[1]);
@@ -60,66 +421,54 @@ int main(int argc, char **argv)
 	// debug mode: use 0 (off) when only N is given as argument
 	int debug = (argc > 2) ? atoi(argv[2]) : 0;
     	
-	timer t;
-	int i;
-	
-	// allocate a large buffer of zeroed memory 
-	global_buff = (int*)calloc(ITEMS, sizeof(int));
-    if (global_buff == NULL) {
-        fprintf(stderr, "Cannot allocate memory!\n");
-        exit(EXIT_FAILURE);
-    }
+	histogram process_hist, thread_hist;
+	histogram_init(&process_hist);
+	histogram_init(&thread_hist);
+	unsigned long long faults;
+
+	allocate_buffer();
             
 	// process reactivity
 	printf("Process reactivity, %d tests...", n); fflush(stdout);
-	pid_t pid;
-	unsigned long int sum = 0;
-	for (i = 0; i < n; i++) {
-		begin(&t);
-		pid = fork();
-		if (pid == -1) {
-			fprintf(stderr, "Can't fork, error %d\n", errno);
-			exit(EXIT_FAILURE);
-		} else if (pid == 0) {
-            int j;
-            for (j = 0; j < ITEMS; j += STEP) {
-                global_buff[j] = j;
-            }
-            free(global_buff);           
-			exit(EXIT_SUCCESS);
-		} else {
-			wait(0);
-		}
-		end(&t);
-		sum += get_microseconds(&t);
-		if (debug)
-			printf("[%d] %lu us\n", i, get_microseconds(&t));
-	}
-	unsigned long int process_avg = sum / n;
+	faults = measure(&MECHANISMS[FORK], n, &process_hist, debug, NULL);
+	unsigned long int process_avg = (unsigned long int)(histogram_mean(&process_hist) / 1000);
 	printf("ok, average: %lu microseconds\n", process_avg);
+	histogram_print(stdout, "Process", &process_hist);
+	if (faults_available)
+		printf("Process page faults: %llu per test\n", faults / n);
 	
 	// thread reactivity
 	printf("Thread reactivity, %d tests...", n); fflush(stdout);
-	pthread_t thread;
-	sum = 0;
-	for (i = 0; i < n; i++) {
-		begin(&t);
-		if (pthread_create(&thread, NULL, thread_fun, NULL) != 0) {
-			fprintf(stderr, "Can't create a new thread, error %d\n", errno);
-			exit(EXIT_FAILURE);
-		}
-		pthread_join(thread, NULL);
-		end(&t);
-		sum += get_microseconds(&t);
-		if (debug)
-			printf("[%d] %lu us\n", i, get_microseconds(&t));
-	}
-	unsigned long int thread_avg = sum / n;
+	faults = measure(&MECHANISMS[PTHREAD_CREATE], n, &thread_hist, debug, NULL);
+	unsigned long int thread_avg = (unsigned long int)(histogram_mean(&thread_hist) / 1000);
 	printf("ok, average: %lu microseconds\n", thread_avg);
+	histogram_print(stdout, "Thread", &thread_hist);
+	if (faults_available)
+		printf("Thread page faults: %llu per test\n", faults / n);
 	
 	float speedup = (float)process_avg / thread_avg;
 	printf("Speedup: %.2f\n", speedup);
+
+	/*
+	 * Dispatch the same work to an already running thread: the gap with
+	 * the thread reactivity above is the per-request latency that a
+	 * thread pool would remove from a thread-per-connection server.
+	 */
+	int k;
+	for (k = POOL_CONDVAR; k <= POOL_SPIN; k++) {
+		histogram pool_hist;
+		histogram_init(&pool_hist);
+		printf("Pooled thread reactivity (%s), %d tests...", MECHANISMS[k].name, n); fflush(stdout);
+		measure(&MECHANISMS[k], n, &pool_hist, debug, NULL);
+		double pool_avg = histogram_mean(&pool_hist) / 1000;
+		printf("ok, average: %.2f microseconds\n", pool_avg);
+		histogram_print(stdout, MECHANISMS[k].name, &pool_hist);
+		printf("Saved per request w.r.t. pthread_create: %.2f microseconds (%.1f%%)\n",
+				histogram_mean(&thread_hist) / 1000 - pool_avg,
+				100.0 * (1.0 - pool_avg * 1000 / histogram_mean(&thread_hist)));
+	}
 	
+	perf_counters_close(&counters);
 	free(global_buff);
 	return EXIT_SUCCESS;
 }
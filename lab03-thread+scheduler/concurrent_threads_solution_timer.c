@@ -3,10 +3,14 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 #define N 1000 // number of threads
 #define M 10000 // number of iterations per thread
 #define V 1 // value added to the balance by each thread at each iteration
+#define CHUNK 1000 // work units grabbed at once by a pool worker
 
 /*
  * Solving race conditions without any os-level synchronization
@@ -23,9 +27,26 @@
  * For questions, send an email to aniello@dis.uniroma1.it
  */
 
+/*
+ * With N = 1000 threads, most of the measured time goes into creating,
+ * scheduling and joining threads rather than into the additions. The
+ * "pool" mode executes the very same n*m work units (one addition of v
+ * each) with a pool of as many threads as online cores: workers grab
+ * CHUNK units at a time from a shared atomic cursor until all units are
+ * taken, and store their total into their own slot of pool_array.
+ * Comparing the two timings separates the scheduling overhead from the
+ * useful work.
+ *
+ * Usage: concurrent_threads_solution_timer [<n> [<m> [<v> [threads|pool|both]]]]
+ */
+
 int n = N, m = M, v = V;
 unsigned long int* shared_array;
 
+unsigned long int* pool_array;
+atomic_ulong next_unit;
+unsigned long int total_units;
+
 void* thread_work(void *arg) {
 	/*
 	 * arg is a pointer to int, so we first need to cast it to int* and
@@ -39,11 +60,69 @@ void* thread_work(void *arg) {
 	return NULL;
 }
 
-int main(int argc, char **argv)
+void* pool_work(void *arg) {
+	int worker_idx = *((int*)arg);
+	/*
+	 * The slots of pool_array share a cache line: adding into them at
+	 * every unit would make the workers invalidate each other's copy
+	 * (false sharing). Each worker sums into a local variable instead,
+	 * and writes its slot only once at the end.
+	 */
+	unsigned long int sum = 0;
+	while (1) {
+		unsigned long int first = atomic_fetch_add(&next_unit, CHUNK);
+		if (first >= total_units) break;
+		unsigned long int last = first + CHUNK;
+		if (last > total_units) last = total_units;
+
+		unsigned long int u;
+		for (u = first; u < last; u++)
+			sum += v;
+	}
+	pool_array[worker_idx] = sum;
+	return NULL;
+}
+
+unsigned long int run_pool() {
+	long int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) workers = 1;
+	total_units = (unsigned long int)n*m;
+	atomic_store(&next_unit, 0);
+	pool_array = (unsigned long int*)calloc(workers, sizeof(unsigned long int));
+	timer t;
+
+	printf("Going to execute %lu work units with a pool of %ld threads, %d units at a time...", total_units, workers, CHUNK); fflush(stdout);
+	pthread_t* threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	int* worker_ids = (int*)malloc(workers * sizeof(int));
+	int i;
+	begin(&t);
+	for (i = 0; i < workers; i++) {
+		worker_ids[i] = i;
+		if (pthread_create(&threads[i], NULL, pool_work, &worker_ids[i]) != 0) {
+			fprintf(stderr, "Can't create a new thread, error %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	unsigned long int computed_value = 0;
+	for (i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+		computed_value += pool_array[i];
+	}
+	end(&t);
+	printf("ok\n");
+
+	unsigned long int expected_value = (unsigned long int)n*m*v;
+	printf("The value computed by the pool is %lu. It should have been %lu\n", computed_value, expected_value);
+	printf("It took %lu milliseconds\n", get_milliseconds(&t));
+
+	free(pool_array);
+	free(threads);
+	free(worker_ids);
+	return get_microseconds(&t);
+}
+
+unsigned long int run_threads()
 {
-	if (argc > 1) n = atoi(argv[1]);
-	if (argc > 2) m = atoi(argv[2]);
-	if (argc > 3) v = atoi(argv[3]);
 	shared_array = (unsigned long int*)calloc(n, sizeof(unsigned long int));
 	timer t;
 	
@@ -95,5 +174,29 @@ int main(int argc, char **argv)
 	free(shared_array);
 	free(threads);
 	free(thread_ids);
+	return get_microseconds(&t);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) n = atoi(argv[1]);
+	if (argc > 2) m = atoi(argv[2]);
+	if (argc > 3) v = atoi(argv[3]);
+	const char* mode = (argc > 4) ? argv[4] : "both";
+
+	if (!strcmp(mode, "threads")) {
+		run_threads();
+	} else if (!strcmp(mode, "pool")) {
+		run_pool();
+	} else if (!strcmp(mode, "both")) {
+		unsigned long int threads_us = run_threads();
+		unsigned long int pool_us = run_pool();
+		printf("One thread per %d units: %lu us, pool: %lu us => %lu us (%.1f%%) spent scheduling threads\n",
+				m, threads_us, pool_us, threads_us > pool_us ? threads_us - pool_us : 0,
+				threads_us ? 100.0 * (threads_us > pool_us ? threads_us - pool_us : 0) / threads_us : 0.0);
+	} else {
+		fprintf(stderr, "Syntax: %s [<n> [<m> [<v> [threads|pool|both]]]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
 	return EXIT_SUCCESS;
 }
@@ -1,6 +1,6 @@
+#include "performance.h" // timer and histogram from lab02-performance-thread
 #include <errno.h>      // contains the global variable errno to determine the type of an error
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     // strerror() formats errno into a human-readable string
@@ -12,12 +12,144 @@
 #define NUM_RESOURCES   3   // number of available special resources
 #define NUM_TASKS       3   // we define the number of work items per thread
 #define THREAD_BURST    5   // determines how many threads are spawned at the same time
+#define NUM_PRIORITIES  3   // priority classes, 0 is the most important one
+#define AGING_INTERVAL  2   // seconds of waiting that promote a waiter by one class
+
+/* A counting semaphore hands the resources out in whatever order the
+ * kernel wakes the waiting threads up. The resource scheduler below
+ * makes the order explicit instead:
+ * - every request joins the tail of a queue, and requests of the same
+ *   class are served in arrival (FIFO) order;
+ * - requests belong to a priority class, and a free resource goes to
+ *   the most important class that is waiting;
+ * - to prevent starvation, a request is promoted by one class for every
+ *   AGING_INTERVAL seconds it has waited, so no request waits more than
+ *   about (NUM_PRIORITIES-1) * AGING_INTERVAL seconds plus the time
+ *   needed to serve the class 0 requests queued ahead of it.
+ * Each waiter sleeps on its own condition variable, so a release wakes
+ * exactly the thread that has been chosen. Wait times are recorded in
+ * one histogram per priority class and printed when the program ends. */
+typedef struct waiter_s {
+    int                 priority;
+    struct timespec     arrival;
+    int                 granted;
+    pthread_cond_t      cond;
+    struct waiter_s*    next;
+} waiter_t;
+
+typedef struct resource_scheduler_s {
+    pthread_mutex_t     mutex;
+    int                 available;
+    waiter_t*           head;       // waiters in arrival order
+    waiter_t*           tail;
+    histogram           wait_times[NUM_PRIORITIES];
+} resource_scheduler_t;
+
+void scheduler_init(resource_scheduler_t* s, int resources) {
+    pthread_mutex_init(&s->mutex, NULL);
+    s->available = resources;
+    s->head = s->tail = NULL;
+
+    int i;
+    for (i = 0; i < NUM_PRIORITIES; ++i)
+        histogram_init(&s->wait_times[i]);
+}
+
+void scheduler_destroy(resource_scheduler_t* s) {
+    pthread_mutex_destroy(&s->mutex);
+}
+
+/* Class a waiter competes in right now, after aging */
+static int effective_priority(waiter_t* w, struct timespec* now) {
+    int promotions = (now->tv_sec - w->arrival.tv_sec) / AGING_INTERVAL;
+    return (w->priority > promotions) ? w->priority - promotions : 0;
+}
+
+/* Hands free resources to the best waiters: must hold s->mutex */
+static void grant_resources(resource_scheduler_t* s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (s->available > 0 && s->head != NULL) {
+        waiter_t *best = NULL, *best_prev = NULL, *prev = NULL, *w;
+        int best_priority = NUM_PRIORITIES;
+
+        // strict comparison: among equals, the oldest waiter wins
+        for (w = s->head; w != NULL; prev = w, w = w->next) {
+            int p = effective_priority(w, &now);
+            if (p < best_priority) {
+                best = w;
+                best_prev = prev;
+                best_priority = p;
+            }
+        }
+
+        // unlink the chosen waiter and wake it up
+        if (best_prev) best_prev->next = best->next;
+        else s->head = best->next;
+        if (s->tail == best) s->tail = best_prev;
+
+        --s->available;
+        best->granted = 1;
+        pthread_cond_signal(&best->cond);
+    }
+}
+
+/* Blocks until a resource is assigned to the caller and returns how
+ * long it had to wait, in milliseconds */
+unsigned long scheduler_acquire(resource_scheduler_t* s, int priority) {
+    waiter_t w;
+    timer t;
+
+    begin(&t);
+    pthread_mutex_lock(&s->mutex);
+
+    w.priority = priority;
+    w.granted = 0;
+    w.next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &w.arrival);
+    pthread_cond_init(&w.cond, NULL);
+
+    if (s->tail) s->tail->next = &w;
+    else s->head = &w;
+    s->tail = &w;
+
+    grant_resources(s); // we may be served right away
+    while (!w.granted)
+        pthread_cond_wait(&w.cond, &s->mutex);
+
+    end(&t);
+    histogram_record_timer(&s->wait_times[priority], &t);
+    pthread_mutex_unlock(&s->mutex);
+
+    pthread_cond_destroy(&w.cond);
+    return get_milliseconds(&t);
+}
+
+void scheduler_release(resource_scheduler_t* s) {
+    pthread_mutex_lock(&s->mutex);
+    ++s->available;
+    grant_resources(s);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void scheduler_print_stats(resource_scheduler_t* s) {
+    pthread_mutex_lock(&s->mutex);
+    int i;
+    for (i = 0; i < NUM_PRIORITIES; ++i) {
+        char label[32];
+        sprintf(label, "Wait times, priority %d", i);
+        histogram_print(stdout, label, &s->wait_times[i]);
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
 
 /* We use a simple structure to encapsulate a thread's arguments */
 typedef struct thread_args_s {
-    int     ID;
-    sem_t*  semaphore;
-    int     num_tasks;
+    int                     ID;
+    resource_scheduler_t*   scheduler;
+    int                     priority;
+    int                     num_tasks;
 } thread_args_t;
 
 
@@ -30,12 +162,8 @@ void* client(void* arg_ptr) {
     /** Process two of the work items assigned to the thread at a time **/
     while (i < args->num_tasks) {
         /* Acquire the resource */
-        int ret = sem_wait(args->semaphore);
-        if (ret) {
-            printf("[FATAL ERROR] Could not lock the semaphore from thread %d: %s\n", args->ID, strerror(errno));
-            exit(1);
-        }
-        printf("[@Thread%d] Resource acquired...\n", args->ID);
+        unsigned long waited = scheduler_acquire(args->scheduler, args->priority);
+        printf("[@Thread%d] Resource acquired after %lu ms (priority %d)...\n", args->ID, waited, args->priority);
 
         sleep(rand() % (MAX_SLEEP+1)); // work item i
         ++i;
@@ -50,11 +178,7 @@ void* client(void* arg_ptr) {
         ++i;
 
         /* Free the resource */
-        ret = sem_post(args->semaphore);
-        if (ret) {
-            printf("[FATAL ERROR] Could not unlock the semaphore from thread %d: %s\n", args->ID, strerror(errno));
-            exit(1);
-        }
+        scheduler_release(args->scheduler);
         printf("[@Thread%d] Resource released!\n", args->ID);
     }
 
@@ -69,18 +193,13 @@ int main(int argc, char* argv[]) {
     printf("We are simulating a system with %d available special resources. Hence, no more "
            "than %d threads can get exclusive access to them at the same time.\n\n", NUM_RESOURCES, NUM_RESOURCES);
 
-    int ret = 0;
     int thread_ID = 0;
 
-    sem_t* semaphore = malloc(sizeof(sem_t)); // we allocate a sem_t object on the heap
-
-    /*** Initialize a semaphore to coordinate access to the resources ***/
-    ret = sem_init(semaphore, 0, NUM_RESOURCES);
+    // we allocate the scheduler on the heap
+    resource_scheduler_t* scheduler = malloc(sizeof(resource_scheduler_t));
 
-    if (ret) {
-        printf("[FATAL ERROR] Could not create a semaphore: %s\n", strerror(errno));
-        exit(1);
-    }
+    /*** Initialize the scheduler that coordinates access to the resources ***/
+    scheduler_init(scheduler, NUM_RESOURCES);
 
     /* Main loop */
     printf("[DRIVER] Press ENTER to spawn %d new threads. Press CTRL+D to quit!\n", THREAD_BURST);
@@ -102,8 +221,9 @@ int main(int argc, char* argv[]) {
             pthread_t thread_handle;
 
             thread_args_t* args = malloc(sizeof(thread_args_t));
-            args->semaphore = semaphore;
+            args->scheduler = scheduler;
             args->ID = thread_ID;
+            args->priority = thread_ID % NUM_PRIORITIES;
             args->num_tasks = NUM_TASKS;
 
             if (pthread_create(&thread_handle, NULL, client, args)) {
@@ -120,12 +240,13 @@ int main(int argc, char* argv[]) {
         printf("==> [DRIVER] Press ENTER to spawn %d new threads. Press CTRL+D to quit!\n", THREAD_BURST);
     }
 
+    scheduler_print_stats(scheduler);
     printf("Exiting...\n");
 
-    /*** Don't forget to destroy the semaphore once you're done ***/
-    sem_destroy(semaphore);
+    /*** Don't forget to destroy the scheduler once you're done ***/
+    scheduler_destroy(scheduler);
 
-    free(semaphore);
+    free(scheduler);
 
     return 0;
 }
@@ -0,0 +1,293 @@
+#include "admission.h"
+
+#include <errno.h>
+#include <fcntl.h>      // O_CREAT and O_EXCL flags
+#include <limits.h>
+#include <signal.h>     // kill()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/** A shared-memory admission controller, replacing the named semaphore.
+ *
+ * The server creates a POSIX shared memory segment holding two ticket
+ * counters, global statistics, one occupancy slot per client process
+ * and one slot per thread that is waiting for or holding a resource.
+ * Clients map it once per process.
+ *
+ * Resources are granted in FIFO order, like at the deli counter: every
+ * acquisition draws a ticket from `next_ticket`, and `now_serving`
+ * counts the releases so far. With N resources, ticket t may proceed as
+ * soon as t < now_serving + N, so tickets are served in the order they
+ * were drawn and nobody can be overtaken forever. Drawing a ticket that
+ * is served at once and releasing it are atomic increments: no system
+ * call at all, unless somebody has to sleep. Waiters sleep on the
+ * `now_serving` word through a futex, which the kernel can share between
+ * processes since the segment is mapped with MAP_SHARED (hence no
+ * FUTEX_PRIVATE_FLAG). Each release grants exactly one more ticket, so
+ * waiters sleep with the bit `ticket % 32` of a FUTEX_WAIT_BITSET and the
+ * release wakes that bit only, instead of the whole queue.
+ *
+ * Every ticket is recorded in a slot together with the pid of its owner.
+ * A process killed while waiting or holding a resource never releases
+ * its tickets, so the monitor periodically checks the owners with
+ * kill(pid, 0) and gives back the tickets of the dead ones.
+ *
+ * The monitor sleeps on `generation`, which is bumped when a thread
+ * joins or leaves the line and when a client attaches or detaches. Only
+ * the first change after the monitor parks pays for a FUTEX_WAKE, and
+ * those paths make system calls anyway. Uncontended acquisitions and
+ * releases do not touch it, so that they stay in user space: the monitor
+ * picks them up when its timeout expires. **/
+
+static int my_slot = -1; // slot of the current process in ctl->clients
+static int my_pid;
+
+static long futex(void* addr, int op, unsigned int val, const struct timespec* timeout, unsigned int bitset) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, bitset);
+}
+
+static unsigned long int now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static admission_t* map_segment(int fd) {
+    admission_t* ctl = mmap(NULL, sizeof(admission_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid
+    return (ctl == MAP_FAILED) ? NULL : ctl;
+}
+
+/* Tickets may wrap around, and once a ticket is served later ones may be
+ * released before it, so we compare them through a signed difference */
+static int is_served(admission_t* ctl, unsigned int ticket) {
+    return (int)(ticket - atomic_load(&ctl->now_serving)) < ctl->num_resources;
+}
+
+admission_t* admission_create(int num_resources) {
+    int fd = shm_open(ADMISSION_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        printf("[WARNING] The shared memory segment already exists. Did you forget to destroy it? :-)\n");
+        shm_unlink(ADMISSION_SHM_NAME);
+        fd = shm_open(ADMISSION_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd == -1) return NULL;
+
+    // a new segment is empty: size it, and the kernel zero-fills it
+    if (ftruncate(fd, sizeof(admission_t))) {
+        close(fd);
+        return NULL;
+    }
+
+    admission_t* ctl = map_segment(fd);
+    if (ctl == NULL) return NULL;
+
+    ctl->num_resources = num_resources;
+    return ctl;
+}
+
+void admission_destroy(admission_t* ctl) {
+    munmap(ctl, sizeof(admission_t));
+    shm_unlink(ADMISSION_SHM_NAME);
+}
+
+static void notify_monitor(admission_t* ctl) {
+    atomic_fetch_add(&ctl->generation, 1);
+    if (atomic_exchange(&ctl->monitor_parked, 0))
+        futex(&ctl->generation, FUTEX_WAKE, INT_MAX, NULL, 0);
+}
+
+unsigned int admission_wait_change(admission_t* ctl, unsigned int last_generation, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    while (1) {
+        atomic_store(&ctl->monitor_parked, 1);
+        unsigned int g = atomic_load(&ctl->generation);
+        if (g != last_generation) return g;
+        // sleeps only if nothing has changed since the check above
+        if (futex(&ctl->generation, FUTEX_WAIT, g, &timeout, 0) == -1 && errno == ETIMEDOUT)
+            return g; // nothing changed, but the caller gets a chance to run admission_reclaim()
+    }
+}
+
+/* Frees a ticket slot and serves the next ticket in line */
+static void give_back(admission_t* ctl, admission_ticket_t* t) {
+    atomic_store(&t->state, TICKET_FREE);
+    atomic_store(&t->pid, 0);
+    unsigned int serving = atomic_fetch_add(&ctl->now_serving, 1) + 1;
+
+    /* A waiter increments `waiters` before sleeping, and FUTEX_WAIT does
+     * not sleep if `now_serving` has changed: either we see the waiter
+     * here, or the waiter sees our increment. Only the ticket that has
+     * just been granted can proceed, so we wake its bit only. */
+    if (atomic_load(&ctl->waiters) > 0) {
+        unsigned int granted = serving + ctl->num_resources - 1;
+        futex(&ctl->now_serving, FUTEX_WAKE_BITSET, INT_MAX, NULL, 1u << (granted % 32));
+    }
+}
+
+static int is_dead(int pid) {
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+int admission_reclaim(admission_t* ctl) {
+    int i, changed = 0, reclaimed = 0;
+
+    for (i = 0; i < ADMISSION_MAX_TICKETS; ++i) {
+        admission_ticket_t* t = &ctl->tickets[i];
+        int pid = atomic_load(&t->pid);
+        if (pid == 0 || !is_dead(pid)) continue;
+
+        int state = atomic_load(&t->state);
+        if (state == TICKET_HOLDING || state == TICKET_WAITING) {
+            /* A waiting ticket is given back only when its turn comes:
+             * releasing it earlier would grant one more resource to the
+             * tickets ahead of it, beyond the capacity. */
+            if (state == TICKET_WAITING && !is_served(ctl, atomic_load(&t->ticket))) continue;
+            give_back(ctl, t);
+            ++reclaimed;
+        } else {
+            /* The process died between claiming the slot and recording
+             * its ticket: if the ticket had been drawn already, it is lost
+             * and one resource with it. It takes a kill in the middle of
+             * two atomic operations, though. */
+            atomic_store(&t->state, TICKET_FREE);
+            atomic_store(&t->pid, 0);
+        }
+        changed = 1;
+    }
+
+    // drop the occupancy slots of dead processes as well
+    for (i = 0; i < ADMISSION_MAX_CLIENTS; ++i) {
+        int pid = atomic_load(&ctl->clients[i].pid);
+        if (pid == 0 || !is_dead(pid)) continue;
+        atomic_store(&ctl->clients[i].pid, 0);
+        changed = 1;
+    }
+
+    if (reclaimed) atomic_fetch_add(&ctl->reclaimed, reclaimed);
+    if (changed) notify_monitor(ctl);
+    return reclaimed;
+}
+
+/* Tickets drawn and not released yet: the first num_resources of them
+ * are being served, the others are waiting */
+static int outstanding(admission_t* ctl) {
+    unsigned int serving = atomic_load(&ctl->now_serving); // read first, it never passes next_ticket
+    return (int)(atomic_load(&ctl->next_ticket) - serving);
+}
+
+int admission_in_use(admission_t* ctl) {
+    int n = outstanding(ctl);
+    return (n < ctl->num_resources) ? n : ctl->num_resources;
+}
+
+int admission_waiting(admission_t* ctl) {
+    int n = outstanding(ctl);
+    return (n > ctl->num_resources) ? n - ctl->num_resources : 0;
+}
+
+admission_t* admission_open() {
+    int fd = shm_open(ADMISSION_SHM_NAME, O_RDWR, 0); // no O_CREAT: the server must be running!
+    if (fd == -1) return NULL;
+
+    admission_t* ctl = map_segment(fd);
+    if (ctl == NULL) return NULL;
+
+    // claim a free occupancy slot for this process
+    int i;
+    my_pid = getpid();
+    for (i = 0; i < ADMISSION_MAX_CLIENTS; ++i) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&ctl->clients[i].pid, &expected, my_pid)) {
+            my_slot = i;
+            atomic_store(&ctl->clients[i].in_use, 0);
+            atomic_store(&ctl->clients[i].waiting, 0);
+            atomic_store(&ctl->clients[i].acquisitions, 0);
+            break;
+        }
+    }
+    if (my_slot == -1) {
+        munmap(ctl, sizeof(admission_t));
+        errno = EUSERS;
+        return NULL;
+    }
+
+    notify_monitor(ctl);
+    return ctl;
+}
+
+void admission_close(admission_t* ctl) {
+    atomic_store(&ctl->clients[my_slot].pid, 0);
+    notify_monitor(ctl);
+    munmap(ctl, sizeof(admission_t));
+    my_slot = -1;
+}
+
+static int claim_ticket_slot(admission_t* ctl) {
+    while (1) {
+        unsigned int serving = atomic_load(&ctl->now_serving);
+        int i;
+        for (i = 0; i < ADMISSION_MAX_TICKETS; ++i) {
+            int expected = 0;
+            if (atomic_compare_exchange_strong(&ctl->tickets[i].pid, &expected, my_pid)) {
+                atomic_store(&ctl->tickets[i].state, TICKET_TAKING);
+                return i;
+            }
+        }
+
+        // all the slots are taken: any release frees one
+        atomic_fetch_add(&ctl->waiters, 1);
+        futex(&ctl->now_serving, FUTEX_WAIT_BITSET, serving, NULL, FUTEX_BITSET_MATCH_ANY);
+        atomic_fetch_sub(&ctl->waiters, 1);
+    }
+}
+
+int admission_acquire(admission_t* ctl) {
+    admission_client_t* me = &ctl->clients[my_slot];
+    unsigned long int wait_start = 0;
+
+    int slot = claim_ticket_slot(ctl);
+    admission_ticket_t* t = &ctl->tickets[slot];
+    unsigned int ticket = atomic_fetch_add(&ctl->next_ticket, 1);
+    atomic_store(&t->ticket, ticket);
+    atomic_store(&t->state, TICKET_WAITING);
+
+    while (1) {
+        // fast path: our ticket is within the first num_resources in line
+        unsigned int serving = atomic_load(&ctl->now_serving);
+        if ((int)(ticket - serving) < ctl->num_resources) break;
+
+        // slow path: sleep until a release changes `now_serving`
+        if (!wait_start) {
+            wait_start = now_ns();
+            atomic_fetch_add(&me->waiting, 1);
+            notify_monitor(ctl);
+        }
+        atomic_fetch_add(&ctl->waiters, 1);
+        futex(&ctl->now_serving, FUTEX_WAIT_BITSET, serving, NULL, 1u << (ticket % 32));
+        atomic_fetch_sub(&ctl->waiters, 1);
+    }
+    atomic_store(&t->state, TICKET_HOLDING);
+
+    if (wait_start) {
+        atomic_fetch_sub(&me->waiting, 1);
+        atomic_fetch_add(&ctl->contended, 1);
+        atomic_fetch_add(&ctl->total_wait_ns, now_ns() - wait_start);
+    }
+    atomic_fetch_add(&ctl->acquisitions, 1);
+    atomic_fetch_add(&me->acquisitions, 1);
+    atomic_fetch_add(&me->in_use, 1);
+    if (wait_start) notify_monitor(ctl); // we have left the line
+    return slot;
+}
+
+void admission_release(admission_t* ctl, int slot) {
+    atomic_fetch_sub(&ctl->clients[my_slot].in_use, 1);
+    give_back(ctl, &ctl->tickets[slot]);
+}
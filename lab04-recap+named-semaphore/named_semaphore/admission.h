@@ -0,0 +1,66 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define ADMISSION_SHM_NAME      "/simple_scheduler_shm"
+#define ADMISSION_MAX_CLIENTS   64  // client processes that can be attached at the same time
+#define ADMISSION_MAX_TICKETS   256 // threads that can wait for or hold a resource at the same time
+
+/* States of a ticket slot */
+#define TICKET_FREE     0
+#define TICKET_TAKING   1   // slot claimed, ticket being drawn
+#define TICKET_WAITING  2
+#define TICKET_HOLDING  3
+
+/* Per-process occupancy, updated by the client library and read live
+ * by the server's monitor */
+typedef struct admission_client_s {
+    atomic_int      pid;            // 0 when the slot is free
+    atomic_int      in_use;         // resources currently held by the process
+    atomic_int      waiting;        // threads of the process blocked in admission_acquire()
+    atomic_ulong    acquisitions;
+} admission_client_t;
+
+/* One slot per thread between admission_acquire() and admission_release(),
+ * recording who owns which ticket so that the monitor can give back the
+ * tickets of a process that died */
+typedef struct admission_ticket_s {
+    atomic_int      pid;            // 0 when the slot is free
+    atomic_int      state;
+    atomic_uint     ticket;
+} admission_ticket_t;
+
+/* Layout of the shared memory segment created by the server */
+typedef struct admission_s {
+    int             num_resources;
+    atomic_uint     next_ticket;    // next ticket to hand out
+    atomic_uint     now_serving;    // releases so far, futex word for the waiters
+    atomic_int      waiters;
+    atomic_uint     generation;     // futex word for the monitor, bumped when the line or the clients change
+    atomic_int      monitor_parked;
+    atomic_ulong    acquisitions;
+    atomic_ulong    contended;      // acquisitions that had to sleep in the kernel
+    atomic_ulong    total_wait_ns;
+    atomic_ulong    reclaimed;      // tickets given back on behalf of dead processes
+    admission_client_t clients[ADMISSION_MAX_CLIENTS];
+    admission_ticket_t tickets[ADMISSION_MAX_TICKETS];
+} admission_t;
+
+/* server side */
+admission_t* admission_create(int num_resources);
+void admission_destroy(admission_t* ctl);
+unsigned int admission_wait_change(admission_t* ctl, unsigned int last_generation, int timeout_ms);
+int admission_reclaim(admission_t* ctl);
+int admission_in_use(admission_t* ctl);
+int admission_waiting(admission_t* ctl);
+
+/* client side: open once per process, then acquire/release from any thread.
+ * admission_acquire() returns the ticket slot to pass to admission_release() */
+admission_t* admission_open();
+void admission_close(admission_t* ctl);
+int admission_acquire(admission_t* ctl);
+void admission_release(admission_t* ctl, int slot);
+
+#endif
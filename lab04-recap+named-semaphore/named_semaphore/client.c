@@ -1,6 +1,7 @@
+#include "admission.h"
+
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +10,11 @@
 
 #define MAX_SLEEP           6
 #define THREAD_BURST        5
-#define SEMAPHORE_NAME      "/simple_scheduler"
+
+/* The admission controller is opened once per process and shared by all
+ * of its threads: acquiring a free resource does not even need a system
+ * call, since it is a single atomic operation on shared memory. */
+admission_t* controller;
 
 typedef struct thread_args_s {
     int     ID;
@@ -18,18 +23,8 @@ typedef struct thread_args_s {
 void* client(void *arg_ptr) {
     thread_args_t* args = (thread_args_t*) arg_ptr;
 
-    /*** Open an existing named semaphore - COMPLETE HERE ***/
-    sem_t* my_named_semaphore = sem_open(SEMAPHORE_NAME, 0); // mode is 0: sem_open is not allowed to create it!
-    if (my_named_semaphore == SEM_FAILED) {
-        printf("[FATAL ERROR] Could not open the named semaphore from thread %d, the reason is: %s\n", args->ID, strerror(errno));
-        exit(1);
-    }
-
     /*** Acquire the resource ***/
-    if (sem_wait(my_named_semaphore)) {
-        printf("[FATAL ERROR] Could not lock the semaphore from thread %d, the reason is: %s\n", args->ID, strerror(errno));
-        exit(1);
-    }
+    int ticket_slot = admission_acquire(controller);
 
     printf("[@Thread%d] Resource acquired...\n", args->ID);
 
@@ -37,23 +32,32 @@ void* client(void *arg_ptr) {
     sleep(rand() % (MAX_SLEEP+1));
 
     /*** Free the resource ***/
-    if (sem_post(my_named_semaphore)) {
-        printf("[FATAL ERROR] Could not unlock the semaphore from thread %d, the reason is: %s\n", args->ID, strerror(errno));
-        exit(1);
-    }
+    admission_release(controller, ticket_slot);
 
     printf("[@Thread%d] Done. Resource released!\n", args->ID);
 
-    /*** Close the named semaphore - COMPLETE HERE ***/
-    sem_close(my_named_semaphore);
-
     free(args);
     return NULL;
 }
 
+void close_controller() {
+    admission_close(controller);
+}
+
 int main(int argc, char* argv[]) {
     int thread_ID = 0;
 
+    /*** Open the admission controller created by the server ***/
+    controller = admission_open();
+    if (controller == NULL) {
+        printf("[FATAL ERROR] Could not open the admission controller, the reason is: %s\n", strerror(errno));
+        printf("Please make sure that the server is already running in a separate terminal.\n");
+        exit(1);
+    }
+
+    // release our occupancy slot when the last thread terminates
+    atexit(close_controller);
+
     printf("Welcome! This is a simple client for our FCFS scheduler.\n\n");
     printf("Please make sure that the server is already running in a separate terminal.\n\n");
 
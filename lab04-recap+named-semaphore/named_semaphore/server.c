@@ -1,62 +1,42 @@
+#include "admission.h"
 #include "util.h"
 
 #include <errno.h>
-#include <fcntl.h>  // O_CREAT and O_EXCL flags
-#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#define LOG_INTERVAL        1
 #define NUM_RESOURCES       3
-#define SEMAPHORE_NAME      "/simple_scheduler"
+#define RECLAIM_INTERVAL    1000    // ms
 
-// we use a global variable to store a pointer to the named semaphore
-sem_t* named_semaphore;
+// we use a global variable to store a pointer to the shared admission controller
+admission_t* controller;
 
 void cleanup() {
-    /** Close and then unlink the named semaphore **/
+    /** Unmap and then unlink the shared memory segment **/
     printf("\rShutting down the server...\n");
 
-    sem_close(named_semaphore);
-
-    /* We unlink the semaphore, otherwise it would remain in the
+    /* We unlink the segment, otherwise it would remain in the
      * system after the server dies. */
-    sem_unlink(SEMAPHORE_NAME);
+    admission_destroy(controller);
 
     exit(0);
 }
 
 int main(int argc, char* argv[]) {
-    int ret;
-
-    /** Create a named semaphore to be shared with different processes.
-     *
-     * O_CREAT tells the system to create the semaphore named SEMAPHORE_NAMED
-     * if it does not already exist. When used in an OR combination with
-     * O_EXCL, the call fails if the semaphore already exists.
+    /** Create the shared memory segment of the admission controller.
      *
-     * Mode 0600 means that only the processes owned by the user that creates
-     * the semaphore can access it, with read & write (4+2) permissions.
-     *
-     * We initialize the semaphore with a value equal to NUM_RESOURCES.
+     * The segment is created with O_CREAT | O_EXCL and mode 0600 (see
+     * admission.c): if a segment with the same name already exists, it
+     * is removed and created again. It starts with NUM_RESOURCES free
+     * resources, and clients map it with admission_open().
      **/
+    controller = admission_create(NUM_RESOURCES);
 
-    named_semaphore = sem_open(SEMAPHORE_NAME, O_CREAT | O_EXCL, 0600, NUM_RESOURCES);
-
-    if (named_semaphore == SEM_FAILED && errno == EEXIST) {
-        printf("[WARNING] The named semaphore already exits. Did you forget to destroy it? :-)\n");
-
-        sem_unlink(SEMAPHORE_NAME);
-
-        // now we can try to create the semaphore from scratch
-        named_semaphore = sem_open(SEMAPHORE_NAME, O_CREAT | O_EXCL, 0600, NUM_RESOURCES);
-    }
-
-    if (named_semaphore == SEM_FAILED) {
-        printf("[FATAL ERROR] Could not open the named semaphore, the reason is: %s\n", strerror(errno));
+    if (controller == NULL) {
+        printf("[FATAL ERROR] Could not create the shared memory segment, the reason is: %s\n", strerror(errno));
         exit(1);
     }
 
@@ -69,28 +49,50 @@ int main(int argc, char* argv[]) {
     printf("%d resources are initially available in the system. Use CTRL+C to exit!\n\n", NUM_RESOURCES);
 
     /* Main loop */
+    unsigned int generation = 0;
+    unsigned long activity = 0;
     while(1) {
-        /** We want to periodically print statistics on our server's load to screen **/
+        /** Rather than polling the resources every second, we sleep until
+         * a thread joins or leaves the line or a client comes or goes, and
+         * print a snapshot of the live state. Acquisitions and releases
+         * that do not wait never wake us up, to keep them free of system
+         * calls, and a client killed while waiting or holding a resource
+         * changes nothing: so we also wake up every RECLAIM_INTERVAL ms to
+         * give back the tickets of dead clients and to print a snapshot
+         * if any resource has been acquired or released in the meantime **/
+        unsigned int g = admission_wait_change(controller, generation, RECLAIM_INTERVAL);
+        int reclaimed = admission_reclaim(controller);
+        if (reclaimed) printf("           reclaimed %d tickets of dead clients\n", reclaimed);
+
+        // both counters only grow: their sum changes at every acquisition or release
+        unsigned long a = atomic_load(&controller->acquisitions) + atomic_load(&controller->now_serving);
+        if (g == generation && a == activity) continue;
+        generation = g;
+        activity = a;
+
         char timestamp[9];
         time_t now = time(0);
 
         // get a timestamp of the form "HH:MM:SS" and store it into a buffer
         strftime((char*)timestamp, 9, "%H:%M:%S", localtime(&now));
 
-        /** Get the current value for the semaphore and store it into a
-         * custom local variable (we pass its address through &). The
-         * value of the semaphore is the number of resources not in use. **/
-        int current_value;
-        ret = sem_getvalue(named_semaphore, &current_value);
-
-        if (ret) {
-            printf("[FATAL ERROR] Could not access the named semaphore, the reason is: %s\n", strerror(errno));
-            exit(1);
+        int in_use = admission_in_use(controller);
+        printf("[%s] %d resources are available and %d are in use, %d threads in line\n", timestamp,
+               NUM_RESOURCES - in_use, in_use, admission_waiting(controller));
+
+        int i;
+        for (i = 0; i < ADMISSION_MAX_CLIENTS; ++i) {
+            admission_client_t* client = &controller->clients[i];
+            int pid = atomic_load(&client->pid);
+            if (pid == 0) continue;
+            printf("           client %d: %d in use, %d waiting, %lu acquisitions\n", pid,
+                   atomic_load(&client->in_use), atomic_load(&client->waiting), atomic_load(&client->acquisitions));
         }
 
-        printf("[%s] %d resources are available and %d are in use\n", timestamp, current_value, NUM_RESOURCES - current_value);
-
-        sleep(LOG_INTERVAL);
+        unsigned long acquisitions = atomic_load(&controller->acquisitions);
+        unsigned long contended = atomic_load(&controller->contended);
+        printf("           %lu acquisitions, %lu had to wait (%.1f ms on average)\n", acquisitions, contended,
+               contended ? atomic_load(&controller->total_wait_ns) / 1e6 / contended : 0.0);
     }
 
     /*** We will never reach this point since we want to exit the program through CTRL+C only! ***/
@@ -1,7 +1,9 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>  // htons() and inet_addr()
 #include <netinet/in.h> // struct sockaddr_in
@@ -9,15 +11,194 @@
 
 #include "common.h"
 
+/* Send the whole buffer, dealing with partial writes */
+void send_all(int socket_desc, const char* buf, size_t len) {
+    while (len > 0) {
+        int ret = send(socket_desc, buf, len, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Cannot write to socket");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* Pipelined client (-k): send num_requests TIME requests on the same
+ * connection, keeping up to depth of them in flight, i.e., sent but not
+ * answered yet. Requests that leave together are sent with one send(). */
+void pipelined_client(int socket_desc, unsigned long num_requests, int depth) {
+    char request[16];
+    size_t request_len = sprintf(request, "%s%c", SERVER_COMMAND, REQUEST_DELIMITER);
+
+    char* send_buf = malloc(request_len * depth);
+    char recv_buf[PIPELINE_BUF_SIZE];
+    char last_reply[64] = "";
+    size_t last_reply_len = 0;
+    int new_reply = 1;
+
+    unsigned long sent = 0, answered = 0, recvs = 0;
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    while (answered < num_requests) {
+        // top the window up: one send() for all the requests we can add
+        unsigned long window = depth - (sent - answered);
+        if (window > num_requests - sent) window = num_requests - sent;
+        if (window > 0) {
+            for (unsigned long i = 0; i < window; i++)
+                memcpy(send_buf + i * request_len, request, request_len);
+            send_all(socket_desc, send_buf, window * request_len);
+            sent += window;
+        }
+
+        // there is at least one request in flight: wait for some replies
+        int recv_bytes;
+        while ( (recv_bytes = recv(socket_desc, recv_buf, sizeof(recv_buf), 0)) < 0 ) {
+            if (errno == EINTR) continue;
+            ERROR_HELPER(-1, "Cannot read from socket");
+        }
+        if (recv_bytes == 0) ERROR_HELPER(-1, "Connection closed unexpectedly");
+        if (answered == 0 && recv_bytes >= 4 && !memcmp(recv_buf, "BUSY", 4)) {
+            fprintf(stderr, "%.*s", recv_bytes, recv_buf);
+            exit(EXIT_FAILURE);
+        }
+        recvs++;
+
+        // every reply ends with a newline; remember the last one to show it
+        for (int i = 0; i < recv_bytes; i++) {
+            if (new_reply || last_reply_len == sizeof(last_reply) - 1) last_reply_len = 0;
+            last_reply[last_reply_len++] = recv_buf[i];
+            new_reply = (recv_buf[i] == '\n');
+            if (new_reply) {
+                answered++;
+                last_reply[last_reply_len] = '\0';
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf("%lu requests in %.3f seconds (%.0f requests/s, %.1f replies per recv)\n",
+           num_requests, elapsed, num_requests / elapsed, (double)num_requests / recvs);
+    printf("Last answer from server: %s", last_reply);
+
+    free(send_buf);
+}
+
+/* UDP load (-u -k): send num_requests queries keeping up to depth of them
+ * in flight, with batches of UDP_BATCH datagrams per sendmmsg() and
+ * recvmmsg(). Datagrams can be dropped: when no reply arrives within
+ * UDP_TIMEOUT_MS, the queries still in flight are counted as lost. */
+void udp_client(int socket_desc, unsigned long num_requests, int depth) {
+    char request[16];
+    size_t request_len = sprintf(request, "%s", SERVER_COMMAND);
+
+    // the socket is connected: no addresses needed, all queries are equal
+    struct iovec  request_iov = { request, request_len };
+    struct mmsghdr out[UDP_BATCH];
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        out[i].msg_hdr.msg_iov    = &request_iov;
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    char replies[UDP_BATCH][64];
+    struct iovec reply_iov[UDP_BATCH];
+    struct mmsghdr in[UDP_BATCH];
+    memset(in, 0, sizeof(in));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        reply_iov[i].iov_base = replies[i];
+        reply_iov[i].iov_len  = sizeof(replies[i]) - 1;
+        in[i].msg_hdr.msg_iov    = &reply_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    struct timeval timeout = { 0, UDP_TIMEOUT_MS * 1000 };
+    int ret = setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ERROR_HELPER(ret, "Cannot set receive timeout");
+
+    unsigned long sent = 0, answered = 0, lost = 0, in_flight = 0, recvs = 0;
+    char last_reply[64] = "";
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    while (answered + lost < num_requests) {
+        // top the window up, UDP_BATCH datagrams at a time
+        while (in_flight < depth && sent < num_requests) {
+            unsigned long batch = depth - in_flight;
+            if (batch > num_requests - sent) batch = num_requests - sent;
+            if (batch > UDP_BATCH) batch = UDP_BATCH;
+
+            ret = sendmmsg(socket_desc, out, batch, 0);
+            if (ret < 0 && errno == EINTR) continue;
+            ERROR_HELPER(ret, "Cannot send UDP datagrams");
+            sent += ret;
+            in_flight += ret;
+        }
+
+        int received = recvmmsg(socket_desc, in, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) ERROR_HELPER(-1, "Cannot receive UDP datagrams");
+
+            // timeout: whatever is still in flight is not coming back
+            lost += in_flight;
+            in_flight = 0;
+            continue;
+        }
+        recvs++;
+
+        // late replies to queries already counted as lost are ignored
+        if (received > in_flight) received = in_flight;
+        answered  += received;
+        in_flight -= received;
+
+        if (received > 0) {
+            replies[received - 1][in[received - 1].msg_len] = '\0';
+            strcpy(last_reply, replies[received - 1]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf("%lu queries in %.3f seconds (%.0f queries/s, %.1f replies per recvmmsg), %lu lost\n",
+           num_requests, elapsed, answered / elapsed, recvs ? (double)answered / recvs : 0.0, lost);
+    printf("Last answer from server: %s", last_reply);
+}
+
 int main(int argc, char* argv[]) {
     int ret;
 
+    // by default we send a single request, as in the original protocol
+    unsigned long num_requests = 0;
+    int depth = PIPELINE_DEPTH;
+    int udp = 0;
+    int opt;
+    while ( (opt = getopt(argc, argv, "k:d:u")) != -1 ) {
+        switch (opt) {
+            case 'k': num_requests = strtoul(optarg, NULL, 10); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'u': udp = 1; break;
+            default:  num_requests = 0; depth = 0; break;
+        }
+    }
+    if (depth <= 0 || optind != argc) {
+        fprintf(stderr, "Syntax: %s [-u] [-k <requests> [-d <depth>]]\n"
+                "  -u   talk to the server over UDP instead of TCP\n"
+                "  -k   send <requests> pipelined requests (on a persistent connection with TCP)\n"
+                "  -d   max number of requests in flight (default: %d)\n", argv[0], PIPELINE_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+
     // variables for handling a socket
     int socket_desc;
     struct sockaddr_in server_addr = {0}; // some fields are required to be filled with 0
 
     // create a socket
-    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    socket_desc = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
     ERROR_HELPER(socket_desc, "Could not create socket");
 
     // set up parameters for the connection
@@ -25,12 +206,31 @@ int main(int argc, char* argv[]) {
     server_addr.sin_family      = AF_INET;
     server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
 
-    // initiate a connection on the socket
+    /* initiate a connection on the socket: for a UDP socket this only sets
+     * the default destination, so we can use send() and recv() as well */
     ret = connect(socket_desc, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
     ERROR_HELPER(ret, "Could not create connection");
 
     if (DEBUG) fprintf(stderr, "Connection established!\n");
 
+    if (num_requests > 0) {
+        if (udp)
+            udp_client(socket_desc, num_requests, depth);
+        else
+            pipelined_client(socket_desc, num_requests, depth);
+
+        ret = close(socket_desc);
+        ERROR_HELPER(ret, "Cannot close socket");
+        exit(EXIT_SUCCESS);
+    }
+
+    // a lost datagram would leave us waiting forever for the reply
+    if (udp) {
+        struct timeval timeout = { 0, UDP_TIMEOUT_MS * 1000 };
+        ret = setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ERROR_HELPER(ret, "Cannot set receive timeout");
+    }
+
     // send command to server
     char* command = SERVER_COMMAND;
     size_t command_len = strlen(command);
@@ -9,14 +9,38 @@
         }                                                           \
     } while(0)
 
-#define ERROR_HELPER(ret, msg)      GENERIC_ERROR_HELPER((ret < 0), errno, msg)
+#define ERROR_HELPER(ret, msg)          GENERIC_ERROR_HELPER((ret < 0), errno, msg)
+#define PTHREAD_ERROR_HELPER(ret, msg)  GENERIC_ERROR_HELPER((ret != 0), ret, msg)
 
 /* Configuration parameters */
 #define DEBUG           1   // display debug messages
-#define MAX_CONN_QUEUE  3   // max number of connections the server can queue
+#define MAX_CONN_QUEUE  1024    // max number of connections the server can queue
+/* Clients send TIME right after connecting: with TCP_DEFER_ACCEPT the
+ * server only accepts a connection when its request has arrived */
+#define DEFER_ACCEPT_SECS   5
+#define FASTOPEN_QUEUE      256 // pending TCP Fast Open requests, 0 disables it
 #define SERVER_ADDRESS  "127.0.0.1"
 #define SERVER_COMMAND  "TIME"
 #define SERVER_PORT     2015
 
+/* Persistent connections (server -k, client -k): requests are terminated
+ * by a newline, so that a client can send many of them back to back */
+#define REQUEST_DELIMITER   '\n'
+#define INVALID_REPLY       "INVALID REQUEST\n"
+#define PIPELINE_BUF_SIZE   4096    // bytes read by the server with one recv()
+#define PIPELINE_DEPTH      32      // default number of requests in flight (client)
+
+/* Concurrent servers (server -m pool, server -m epoll) */
+#define POOL_THREADS        8       // workers, i.e., clients served at the same time
+#define POOL_QUEUE_SIZE     256     // accepted connections waiting for a worker
+/* With -k a pool worker is taken until its client disconnects: clients
+ * beyond POOL_THREADS get this reply and are closed instead of waiting */
+#define BUSY_REPLY          "BUSY: all workers are serving persistent connections\n"
+#define EPOLL_MAX_EVENTS    64      // events collected by one epoll_wait()
+
+/* UDP mode (server -u, client -u): one datagram per request and reply */
+#define UDP_BATCH           64      // datagrams per recvmmsg()/sendmmsg()
+#define UDP_TIMEOUT_MS      200     // client: replies not received by then are lost
+
 
 #endif
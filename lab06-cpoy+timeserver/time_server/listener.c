@@ -0,0 +1,103 @@
+#define _GNU_SOURCE // accept4()
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>  // sched_setaffinity()
+#include <string.h>
+#include <arpa/inet.h>  // htons()
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_DEFER_ACCEPT, TCP_FASTOPEN
+#include <sys/socket.h>
+
+#include "common.h"
+#include "listener.h"
+
+/* Optional socket options: an old kernel (or a disabled sysctl) is no
+ * reason to refuse to start, so we just warn */
+static void set_option(int desc, int level, int name, int value, const char* label) {
+    if (setsockopt(desc, level, name, &value, sizeof(value)) < 0)
+        fprintf(stderr, "[WARNING] Cannot set %s option: %s\n", label, strerror(errno));
+}
+
+int listener_open(uint16_t port, const listener_opts_t* opts) {
+    int ret;
+
+    // some fields are required to be filled with 0
+    struct sockaddr_in server_addr = {0};
+
+    // initialize socket for listening
+    int socket_desc = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ERROR_HELPER(socket_desc, "Could not create socket");
+
+    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_port        = htons(port); // don't forget about network byte order!
+
+    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
+     * for more details, read about the TIME_WAIT state in the TCP protocol */
+    int reuseaddr_opt = 1;
+    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
+    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
+
+    /* With SO_REUSEPORT several sockets (one per worker) can listen on the
+     * same port: the kernel spreads incoming connections among them */
+    if (opts->reuseport) {
+        int reuseport_opt = 1;
+        ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &reuseport_opt, sizeof(reuseport_opt));
+        ERROR_HELPER(ret, "Cannot set SO_REUSEPORT option");
+    }
+
+    /* TCP_DEFER_ACCEPT keeps a connection in the kernel until the client
+     * sends its first bytes, so accept() only returns connections whose
+     * request is already waiting. Only useful when the client talks first! */
+    if (opts->defer_accept > 0)
+        set_option(socket_desc, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept, "TCP_DEFER_ACCEPT");
+
+    /* TCP Fast Open lets a returning client put its request in the SYN,
+     * saving one round trip (the server side must also be enabled in
+     * net.ipv4.tcp_fastopen) */
+    if (opts->fastopen > 0)
+        set_option(socket_desc, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen, "TCP_FASTOPEN");
+
+    /* Accepted sockets inherit the kernel buffer sizes of the listening
+     * socket. Setting them here, before the handshake, also lets TCP pick
+     * a window scale large enough for the receive buffer. Note that a
+     * fixed size disables the kernel's automatic tuning. */
+    if (opts->rcvbuf > 0)
+        set_option(socket_desc, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+    if (opts->sndbuf > 0)
+        set_option(socket_desc, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+
+    // bind address to socket
+    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sizeof(server_addr));
+    ERROR_HELPER(ret, "Cannot bind address to socket");
+
+    /* start listening: during a connection storm a short queue makes the
+     * kernel drop SYNs, and clients only retry after a 1 second timeout */
+    ret = listen(socket_desc, opts->backlog);
+    ERROR_HELPER(ret, "Cannot listen on socket");
+
+    return socket_desc;
+}
+
+int listener_accept(int listen_desc, struct sockaddr_in* client_addr, int flags) {
+    while (1) {
+        socklen_t sockaddr_len = sizeof(struct sockaddr_in);
+        int client_desc = accept4(listen_desc, (struct sockaddr*) client_addr, &sockaddr_len, flags);
+        if (client_desc >= 0) return client_desc;
+
+        // the client gave up while its connection was still queued
+        if (errno == ECONNABORTED || errno == EPROTO) continue;
+        return -1;
+    }
+}
+
+int listener_pin_to_cpu(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    /* pid 0 means the calling thread; threads it creates later inherit the
+     * same mask, hence the handlers of a shard run on the shard's core */
+    return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
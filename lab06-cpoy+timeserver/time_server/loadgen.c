@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>  // htons() and inet_addr()
+#include <netinet/in.h> // struct sockaddr_in
+#include <sys/socket.h>
+
+#include "common.h"
+#include "performance.h" // timer and latency histogram from lab02
+
+/** Load generator for the time server: a number of client threads send
+ *  TIME requests as fast as they can (closed loop: a new request leaves
+ *  as soon as the previous reply arrives) and record the latency of each
+ *  of them. At the end we print the throughput and the latency
+ *  distribution, so we can compare the serial, pool and epoll servers.
+ *
+ *  Without -k every request opens a new connection (as the original
+ *  client does), and its latency includes the TCP handshake; with -k each
+ *  thread sends all its requests on one persistent connection. **/
+
+typedef struct loadgen_args_s {
+    unsigned long   num_requests;
+    int             persistent;
+    histogram       latency;
+} loadgen_args_t;
+
+struct sockaddr_in server_addr = {0};
+
+int open_connection(void) {
+    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    ERROR_HELPER(socket_desc, "Could not create socket");
+
+    int ret = connect(socket_desc, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
+    ERROR_HELPER(ret, "Could not create connection");
+
+    return socket_desc;
+}
+
+void send_all(int socket_desc, const char* buf, size_t len) {
+    while (len > 0) {
+        int ret = send(socket_desc, buf, len, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Cannot write to socket");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* Read one reply: up to the newline with persistent connections, up to
+ * the server closing the connection otherwise */
+void recv_reply(int socket_desc, int persistent) {
+    char buf[64];
+    while (1) {
+        int recv_bytes = recv(socket_desc, buf, sizeof(buf), 0);
+        if (recv_bytes < 0 && errno == EINTR) continue;
+        ERROR_HELPER(recv_bytes, "Cannot read from socket");
+
+        if (recv_bytes == 0) {
+            if (persistent) ERROR_HELPER(-1, "Connection closed unexpectedly");
+            return;
+        }
+        if (recv_bytes >= 4 && !memcmp(buf, "BUSY", 4)) {
+            fprintf(stderr, "%.*s", recv_bytes, buf);
+            exit(EXIT_FAILURE);
+        }
+        // with one request in flight, the newline is the last byte we get
+        if (persistent && buf[recv_bytes - 1] == REQUEST_DELIMITER) return;
+    }
+}
+
+void* client_thread(void* arg) {
+    loadgen_args_t* args = (loadgen_args_t*) arg;
+    histogram_init(&args->latency);
+
+    char request[16];
+    size_t request_len = args->persistent ?
+        sprintf(request, "%s%c", SERVER_COMMAND, REQUEST_DELIMITER) :
+        sprintf(request, "%s", SERVER_COMMAND);
+
+    int socket_desc = args->persistent ? open_connection() : -1;
+
+    timer t;
+    for (unsigned long i = 0; i < args->num_requests; i++) {
+        begin(&t);
+
+        if (!args->persistent) socket_desc = open_connection();
+        send_all(socket_desc, request, request_len);
+        recv_reply(socket_desc, args->persistent);
+        if (!args->persistent) close(socket_desc);
+
+        end(&t);
+        histogram_record_timer(&args->latency, &t);
+    }
+
+    if (args->persistent) close(socket_desc);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int ret;
+
+    int num_threads = 8;
+    unsigned long num_requests = 1000;
+    int persistent = 0;
+
+    int opt;
+    while ( (opt = getopt(argc, argv, "c:n:k")) != -1 ) {
+        switch (opt) {
+            case 'c': num_threads = atoi(optarg); break;
+            case 'n': num_requests = strtoul(optarg, NULL, 10); break;
+            case 'k': persistent = 1; break;
+            default:  num_threads = 0; break;
+        }
+    }
+    if (num_threads <= 0 || num_requests == 0 || optind != argc) {
+        fprintf(stderr, "Syntax: %s [-c <clients>] [-n <requests per client>] [-k]\n"
+                "  -c   number of concurrent clients (default: 8)\n"
+                "  -n   requests sent by each client (default: 1000)\n"
+                "  -k   one persistent connection per client (server -k)\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_addr.s_addr = inet_addr(SERVER_ADDRESS);
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_port        = htons(SERVER_PORT);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    loadgen_args_t* args = malloc(num_threads * sizeof(loadgen_args_t));
+
+    timer total;
+    begin(&total);
+
+    for (int i = 0; i < num_threads; i++) {
+        args[i].num_requests = num_requests;
+        args[i].persistent   = persistent;
+        ret = pthread_create(&threads[i], NULL, client_thread, &args[i]);
+        PTHREAD_ERROR_HELPER(ret, "Could not create a client thread");
+    }
+
+    // each thread has its own histogram: merge them after the join
+    histogram latency;
+    histogram_init(&latency);
+    for (int i = 0; i < num_threads; i++) {
+        ret = pthread_join(threads[i], NULL);
+        PTHREAD_ERROR_HELPER(ret, "Could not join a client thread");
+        histogram_merge(&latency, &args[i].latency);
+    }
+
+    end(&total);
+    double seconds = get_nanoseconds(&total) / 1e9;
+
+    printf("%d clients x %lu requests (%s): %.3f seconds, %.0f requests/s\n",
+           num_threads, num_requests, persistent ? "persistent" : "one per connection",
+           seconds, latency.count / seconds);
+    histogram_print(stdout, "latency", &latency);
+
+    free(threads);
+    free(args);
+    exit(EXIT_SUCCESS);
+}
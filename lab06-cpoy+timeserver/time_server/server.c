@@ -1,4 +1,8 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,14 +10,77 @@
 #include <unistd.h>
 #include <arpa/inet.h>  // htons()
 #include <netinet/in.h> // struct sockaddr_in
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include "common.h"
+#include "listener.h"
+#include "timecache.h"
 
-void connection_handler(int socket_desc) {
-    int ret;
+/* Send the whole buffer, dealing with partial writes. Returns 0 on
+ * success, -1 with errno set otherwise. MSG_NOSIGNAL turns a write to a
+ * connection the client has already closed into an EPIPE error, instead
+ * of a SIGPIPE that would kill the whole server. */
+int send_all(int socket_desc, const char* buf, size_t len) {
+    while (len > 0) {
+        int ret = send(socket_desc, buf, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/** Shared request parser: the serial, pool and epoll servers all build
+ *  their replies with the two functions below. **/
+
+/* Reply to a single request (delimiter excluded); now is the current
+ * timestamp, fetched by the caller once for a whole batch of requests */
+const char* answer_request(const char* request, size_t request_len,
+                           const char* now, size_t now_len, size_t* reply_len) {
     char* allowed_command = SERVER_COMMAND;
     size_t allowed_command_len = strlen(allowed_command);
+
+    if (request_len > 0 && request[request_len - 1] == '\r') request_len--; // telnet
+
+    if (request_len == allowed_command_len && !memcmp(request, allowed_command, allowed_command_len)) {
+        *reply_len = now_len;
+        return now;
+    }
+    *reply_len = strlen(INVALID_REPLY);
+    return INVALID_REPLY;
+}
+
+/* Persistent connections: answer the complete (newline-terminated)
+ * requests at the beginning of buf, appending the replies to send_buf as
+ * long as they fit in send_size bytes. Returns how many bytes of buf have
+ * been consumed; *send_len and *requests are updated accordingly. */
+size_t parse_requests(const char* buf, size_t len, char* send_buf, size_t* send_len,
+                      size_t send_size, unsigned long* requests) {
+    // all these requests arrived together: they share the same answer
+    char now[TIMECACHE_MAX_LEN];
+    size_t now_len = timecache_read(now);
+
+    const char* request = buf;
+    const char* end = buf + len;
+    const char* delimiter;
+    while ( (delimiter = memchr(request, REQUEST_DELIMITER, end - request)) != NULL ) {
+        size_t reply_len;
+        const char* reply = answer_request(request, delimiter - request, now, now_len, &reply_len);
+        if (*send_len + reply_len > send_size) break; // send what we have first
+
+        memcpy(send_buf + *send_len, reply, reply_len);
+        *send_len += reply_len;
+        (*requests)++;
+        request = delimiter + 1;
+    }
+
+    return request - buf;
+}
+
+void connection_handler(int socket_desc) {
+    int ret;
     char send_buf[256];
 
     // receive command from client
@@ -34,19 +101,23 @@ void connection_handler(int socket_desc) {
      */     
     while ( (recv_bytes = recv(socket_desc, recv_buf, recv_buf_len, 0)) < 0 ) {
         if (errno == EINTR) continue;
-        ERROR_HELPER(-1, "Cannot write to socket");
+
+        // a client error only closes its connection: the server goes on
+        if (DEBUG) fprintf(stderr, "Cannot read from socket: %s\n", strerror(errno));
+        close(socket_desc);
+        return;
     }     
 
     if (DEBUG) fprintf(stderr, "Message of %d bytes received\n", recv_bytes);
 
-    // parse command received and write reply in send_buf
-    if (recv_bytes == allowed_command_len && !memcmp(recv_buf, allowed_command, allowed_command_len)) {
-        time_t curr_time;
-        time(&curr_time);
-        sprintf(send_buf, "%s", ctime(&curr_time));
-    } else {
-        sprintf(send_buf, "INVALID REQUEST");
-    }
+    // parse command received and write reply in send_buf (the timestamp
+    // is formatted in advance by the ticker, see timecache.c)
+    char now[TIMECACHE_MAX_LEN];
+    size_t now_len = timecache_read(now);
+    size_t reply_len;
+    const char* reply = answer_request(recv_buf, recv_bytes, now, now_len, &reply_len);
+    memcpy(send_buf, reply, reply_len);
+    send_buf[reply_len] = '\0';
 
     // send reply
     size_t server_message_len = strlen(send_buf);
@@ -59,9 +130,12 @@ void connection_handler(int socket_desc) {
      *
      * For the time being we won't deal with partially sent messages!
      */
-    while ( (ret = send(socket_desc, send_buf, server_message_len, 0)) < 0 ) {
+    while ( (ret = send(socket_desc, send_buf, server_message_len, MSG_NOSIGNAL)) < 0 ) {
         if (errno == EINTR) continue;
-        ERROR_HELPER(-1, "Cannot write to the socket");
+
+        if (DEBUG) fprintf(stderr, "Cannot write to the socket: %s\n", strerror(errno));
+        close(socket_desc);
+        return;
     }
     
     if (DEBUG) fprintf(stderr, "Message of %d bytes sent\n", ret);
@@ -71,46 +145,461 @@ void connection_handler(int socket_desc) {
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 }
 
-int main(int argc, char* argv[]) {
+/* Persistent connections (-k): the client keeps the connection open and
+ * sends newline-terminated TIME requests, possibly many of them without
+ * waiting for the replies (pipelining). Every recv() may thus contain
+ * several requests, plus the beginning of the next one: we answer all the
+ * complete requests with a single send() and keep the rest for later.
+ *
+ * A client may hang up with replies still unread: that is normal with
+ * pipelining, so an error on the connection only closes it. */
+void persistent_connection_handler(int socket_desc) {
     int ret;
 
-    int socket_desc, client_desc;
+    char recv_buf[PIPELINE_BUF_SIZE];
+    size_t pending = 0; // bytes of an incomplete request kept from the previous recv()
 
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0}, client_addr = {0};
+    char send_buf[PIPELINE_BUF_SIZE * 6];
+    size_t send_len;
 
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
+    unsigned long requests = 0, replies = 0;
 
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
+    while (1) {
+        int recv_bytes = recv(socket_desc, recv_buf + pending, sizeof(recv_buf) - pending, 0);
+        if (recv_bytes < 0 && errno == EINTR) continue;
+        if (recv_bytes < 0) {
+            if (DEBUG) fprintf(stderr, "Cannot read from socket: %s\n", strerror(errno));
+            break;
+        }
+        if (recv_bytes == 0) break; // the client closed the connection
+        pending += recv_bytes;
 
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
+        /* A request takes at least 5 bytes and its reply at most 29, so the
+         * replies to a full recv_buf normally fit in one send() */
+        size_t consumed = 0;
+        int failed = 0;
+        do {
+            send_len = 0;
+            consumed += parse_requests(recv_buf + consumed, pending - consumed,
+                                       send_buf, &send_len, sizeof(send_buf), &requests);
+            if (send_len > 0) {
+                failed = send_all(socket_desc, send_buf, send_len) < 0;
+                replies++;
+            }
+        } while (send_len > 0 && !failed);
+        if (failed) {
+            if (DEBUG) fprintf(stderr, "Cannot write to the socket: %s\n", strerror(errno));
+            break;
+        }
+
+        // move the incomplete request (if any) to the front of the buffer
+        pending -= consumed;
+        memmove(recv_buf, recv_buf + consumed, pending);
+
+        // a "request" filling the whole buffer can't be valid: discard it
+        if (pending == sizeof(recv_buf)) {
+            if (send_all(socket_desc, INVALID_REPLY, strlen(INVALID_REPLY)) < 0) break;
+            pending = 0;
+        }
+    }
+
+    if (DEBUG) fprintf(stderr, "%lu requests answered with %lu send()\n", requests, replies);
+
+    // close socket
+    ret = close(socket_desc);
+    ERROR_HELPER(ret, "Cannot close socket for incoming connection");
+}
+
+/* UDP mode (-u): a TIME query fits in one datagram and so does the reply,
+ * thus there is no connection to set up and tear down. With recvmmsg()
+ * we collect up to UDP_BATCH queries with a single system call and we
+ * answer all of them with a single sendmmsg(). The loop never returns. */
+void udp_server(void) {
+    int ret;
+
+    int socket_desc = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    ERROR_HELPER(socket_desc, "Could not create UDP socket");
 
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
     int reuseaddr_opt = 1;
     ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
     ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
 
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_port        = htons(SERVER_PORT);
+    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sizeof(server_addr));
+    ERROR_HELPER(ret, "Cannot bind address to UDP socket");
+
+    // one slot per datagram of a batch, for both directions
+    char                requests[UDP_BATCH][64];
+    struct sockaddr_in  clients[UDP_BATCH];
+    struct iovec        request_iov[UDP_BATCH], reply_iov[UDP_BATCH];
+    struct mmsghdr      in[UDP_BATCH], out[UDP_BATCH];
+    memset(in, 0, sizeof(in));
+    memset(out, 0, sizeof(out));
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        request_iov[i].iov_base = requests[i];
+        request_iov[i].iov_len  = sizeof(requests[i]);
+        in[i].msg_hdr.msg_iov    = &request_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name   = &clients[i];
+
+        // the reply to query i goes back to the address it came from
+        out[i].msg_hdr.msg_iov    = &reply_iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+        out[i].msg_hdr.msg_name   = &clients[i];
+    }
+
+    unsigned long queries = 0, batches = 0;
+
+    while (1) {
+        for (int i = 0; i < UDP_BATCH; i++)
+            in[i].msg_hdr.msg_namelen = sizeof(clients[i]); // recvmmsg() overwrites it
+
+        /* MSG_WAITFORONE: block until a datagram arrives, then also take
+         * those already queued (up to UDP_BATCH) without waiting more */
+        int received = recvmmsg(socket_desc, in, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0 && errno == EINTR) continue;
+        ERROR_HELPER(received, "Cannot receive UDP datagrams");
+
+        // all the queries of a batch share the same answer
+        char now[TIMECACHE_MAX_LEN];
+        size_t now_len = timecache_read(now);
+
+        for (int i = 0; i < received; i++) {
+            size_t request_len = in[i].msg_len;
+            if (request_len > 0 && requests[i][request_len - 1] == REQUEST_DELIMITER) request_len--;
+
+            size_t reply_len;
+            reply_iov[i].iov_base = (void*) answer_request(requests[i], request_len, now, now_len, &reply_len);
+            reply_iov[i].iov_len  = reply_len;
+            out[i].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+        }
+
+        /* sendmmsg() stops at the first datagram it cannot send: skip it
+         * (UDP gives no delivery guarantee anyway) and go on with the rest */
+        int sent = 0;
+        while (sent < received) {
+            ret = sendmmsg(socket_desc, out + sent, received - sent, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                if (DEBUG) fprintf(stderr, "Cannot send UDP reply: %s\n", strerror(errno));
+                ret = 1;
+            }
+            sent += ret;
+        }
+
+        queries += received;
+        batches++;
+        if (DEBUG && (batches & 0xFFFF) == 0)
+            fprintf(stderr, "%lu queries answered, %.1f per recvmmsg()\n", queries, (double)queries / batches);
+    }
+}
+
+/** Thread-pool mode (-m pool): the main thread accepts connections and puts
+ *  their descriptors in a circular buffer, from which POOL_THREADS workers
+ *  take them, as in the producer/consumer scheme of lab05. One slow client
+ *  now only holds up one worker instead of the whole server, and a client
+ *  error only closes that client's connection.
+ *
+ *  With persistent connections (-k) a worker serves the same client until
+ *  it leaves, so at most POOL_THREADS clients are served at once: the
+ *  accept loop counts them in pool_busy and turns away the others with
+ *  BUSY_REPLY, instead of queuing them without an answer. **/
+int     pool_queue[POOL_QUEUE_SIZE];
+int     pool_busy; // persistent connections queued or being served
+int     pool_read_index, pool_write_index;
+sem_t   pool_fill_count, pool_empty_count;
+pthread_mutex_t pool_read_mutex = PTHREAD_MUTEX_INITIALIZER; // many consumers
+
+void* pool_worker(void* arg) {
+    int persistent = (int)(long)arg;
+
+    while (1) {
+        int ret = sem_wait(&pool_fill_count);
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Wait on pool_fill_count failed");
+
+        pthread_mutex_lock(&pool_read_mutex);
+        int client_desc = pool_queue[pool_read_index];
+        pool_read_index = (pool_read_index + 1) % POOL_QUEUE_SIZE;
+        pthread_mutex_unlock(&pool_read_mutex);
+
+        ret = sem_post(&pool_empty_count);
+        ERROR_HELPER(ret, "Post on pool_empty_count failed");
+
+        if (persistent) {
+            persistent_connection_handler(client_desc);
+            __sync_fetch_and_sub(&pool_busy, 1);
+        } else {
+            connection_handler(client_desc);
+        }
+    }
+
+    return NULL;
+}
+
+void pool_server(int socket_desc, int persistent) {
+    int ret;
+
+    ret = sem_init(&pool_fill_count, 0, 0);
+    ERROR_HELPER(ret, "Could not initialize pool_fill_count");
+    ret = sem_init(&pool_empty_count, 0, POOL_QUEUE_SIZE);
+    ERROR_HELPER(ret, "Could not initialize pool_empty_count");
+
+    for (int i = 0; i < POOL_THREADS; i++) {
+        pthread_t thread;
+        ret = pthread_create(&thread, NULL, pool_worker, (void*)(long)persistent);
+        PTHREAD_ERROR_HELPER(ret, "Could not create a pool worker");
+        pthread_detach(thread);
+    }
+
+    struct sockaddr_in client_addr = {0};
+    while (1) {
+        int client_desc = listener_accept(socket_desc, &client_addr, SOCK_CLOEXEC);
+        if (client_desc < 0 && errno == EINTR) continue;
+        ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
+
+        if (persistent && __sync_fetch_and_add(&pool_busy, 1) >= POOL_THREADS) {
+            __sync_fetch_and_sub(&pool_busy, 1);
+            send(client_desc, BUSY_REPLY, strlen(BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(client_desc);
+            if (DEBUG) fprintf(stderr, "All workers busy, connection rejected\n");
+            continue;
+        }
+
+        // the main thread is the only producer: no mutex for write_index
+        ret = sem_wait(&pool_empty_count);
+        ERROR_HELPER(ret, "Wait on pool_empty_count failed");
+        pool_queue[pool_write_index] = client_desc;
+        pool_write_index = (pool_write_index + 1) % POOL_QUEUE_SIZE;
+        ret = sem_post(&pool_fill_count);
+        ERROR_HELPER(ret, "Post on pool_fill_count failed");
+    }
+}
+
+/** Event-driven mode (-m epoll): a single thread serves all connections,
+ *  using non-blocking sockets and epoll to learn which ones are ready.
+ *  Since no call may block, each connection keeps its own buffers: the
+ *  bytes of an incomplete request, and the replies the kernel could not
+ *  take yet. While a connection has unsent replies we stop reading from
+ *  it (waiting for EPOLLOUT instead), so a client that does not read its
+ *  replies cannot make the server buffer without bounds. **/
+typedef struct time_conn_s {
+    int      socket_desc;
+    uint32_t events;        // what we are waiting for: EPOLLIN or EPOLLOUT
+    size_t   pending;       // bytes received and not parsed yet
+    size_t   send_len;      // bytes of replies in send_buf...
+    size_t   sent;          // ... of which already sent
+    char     recv_buf[PIPELINE_BUF_SIZE];
+    char     send_buf[PIPELINE_BUF_SIZE * 6];
+} time_conn_t;
+
+// what conn_serve() wants to do next with a connection
+#define CONN_READ   0
+#define CONN_WRITE  1
+#define CONN_CLOSE  2
+
+/* Send as many buffered replies as the socket takes: returns 1 when the
+ * buffer is empty, 0 when the socket is full, -1 on errors */
+int conn_flush(time_conn_t* conn) {
+    while (conn->sent < conn->send_len) {
+        int ret = send(conn->socket_desc, conn->send_buf + conn->sent,
+                       conn->send_len - conn->sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->sent += ret;
+    }
+    conn->sent = conn->send_len = 0;
+    return 1;
+}
+
+/* Make as much progress as possible on a ready connection */
+int conn_serve(time_conn_t* conn, int persistent) {
+    int ret = conn_flush(conn);
+    if (ret < 0) return CONN_CLOSE;
+    if (ret == 0) return CONN_WRITE;
+
+    // one request per connection: once its reply is out we are done
+    if (!persistent && conn->pending > 0) return CONN_CLOSE;
+
+    unsigned long requests = 0;
+    while (1) {
+        if (persistent) {
+            size_t consumed = parse_requests(conn->recv_buf, conn->pending, conn->send_buf,
+                                             &conn->send_len, sizeof(conn->send_buf), &requests);
+            conn->pending -= consumed;
+            memmove(conn->recv_buf, conn->recv_buf + consumed, conn->pending);
+
+            // a "request" filling the whole buffer can't be valid: discard it
+            if (conn->pending == sizeof(conn->recv_buf) && conn->send_len == 0) {
+                memcpy(conn->send_buf, INVALID_REPLY, strlen(INVALID_REPLY));
+                conn->send_len = strlen(INVALID_REPLY);
+                conn->pending = 0;
+            }
+        }
+
+        if (conn->send_len > 0) {
+            ret = conn_flush(conn);
+            if (ret < 0) return CONN_CLOSE;
+            if (ret == 0) return CONN_WRITE;
+            if (!persistent) return CONN_CLOSE;
+            continue; // there may be more requests in recv_buf
+        }
+
+        int recv_bytes = recv(conn->socket_desc, conn->recv_buf + conn->pending,
+                              sizeof(conn->recv_buf) - conn->pending, 0);
+        if (recv_bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_READ;
+            return CONN_CLOSE;
+        }
+        if (recv_bytes == 0) return CONN_CLOSE;
+        conn->pending += recv_bytes;
+
+        // original protocol: whatever the first recv() returns is the request
+        if (!persistent) {
+            char now[TIMECACHE_MAX_LEN];
+            size_t now_len = timecache_read(now);
+            const char* reply = answer_request(conn->recv_buf, conn->pending, now, now_len, &conn->send_len);
+            memcpy(conn->send_buf, reply, conn->send_len);
+        }
+    }
+}
+
+void epoll_server(int socket_desc, int persistent) {
+    int ret;
+
+    /* the listening socket must not block either: when epoll says it is
+     * readable we accept every queued connection, until EAGAIN */
+    ret = fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL) | O_NONBLOCK);
+    ERROR_HELPER(ret, "Cannot make the listening socket non-blocking");
+
+    int epoll_desc = epoll_create1(EPOLL_CLOEXEC);
+    ERROR_HELPER(epoll_desc, "Cannot create epoll instance");
+
+    struct epoll_event event = {0};
+    event.events   = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the listening socket
+    ret = epoll_ctl(epoll_desc, EPOLL_CTL_ADD, socket_desc, &event);
+    ERROR_HELPER(ret, "Cannot add the listening socket to epoll");
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(epoll_desc, events, EPOLL_MAX_EVENTS, -1);
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ready, "Cannot wait for events");
+
+        for (int i = 0; i < ready; i++) {
+            time_conn_t* conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                struct sockaddr_in client_addr;
+                int client_desc;
+                while ( (client_desc = listener_accept(socket_desc, &client_addr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+                    conn = calloc(1, sizeof(time_conn_t));
+                    conn->socket_desc = client_desc;
+                    conn->events = EPOLLIN;
+
+                    event.events   = EPOLLIN;
+                    event.data.ptr = conn;
+                    ret = epoll_ctl(epoll_desc, EPOLL_CTL_ADD, client_desc, &event);
+                    ERROR_HELPER(ret, "Cannot add a connection to epoll");
+                }
+                if (errno == EMFILE || errno == ENFILE) // out of descriptors: retry later
+                    fprintf(stderr, "[WARNING] Cannot accept connection: %s\n", strerror(errno));
+                else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    ERROR_HELPER(-1, "Cannot open socket for incoming connection");
+                continue;
+            }
+
+            int next = conn_serve(conn, persistent);
+            if (next == CONN_CLOSE) {
+                close(conn->socket_desc); // this also removes it from epoll
+                free(conn);
+                continue;
+            }
+
+            uint32_t wanted = (next == CONN_WRITE) ? EPOLLOUT : EPOLLIN;
+            if (wanted != conn->events) {
+                conn->events   = wanted;
+                event.events   = wanted;
+                event.data.ptr = conn;
+                ret = epoll_ctl(epoll_desc, EPOLL_CTL_MOD, conn->socket_desc, &event);
+                ERROR_HELPER(ret, "Cannot update the events of a connection");
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int socket_desc, client_desc;
+
+    // by default we serve one request per connection, as in the original protocol
+    int persistent = 0, high_resolution = 0, udp = 0;
+    char* mode = "serial";
+    int mode_given = 0;
+    int opt;
+    while ( (opt = getopt(argc, argv, "kHum:")) != -1 ) {
+        switch (opt) {
+            case 'k': persistent = 1; break;
+            case 'H': high_resolution = 1; break;
+            case 'u': udp = 1; break;
+            case 'm': mode = optarg; mode_given = 1; break;
+            default:  mode = NULL; break;
+        }
+    }
+    // -k and -m only make sense for TCP: don't silently ignore them with -u
+    if (mode == NULL || optind != argc || (udp && (persistent || mode_given)) ||
+            (strcmp(mode, "serial") && strcmp(mode, "pool") && strcmp(mode, "epoll"))) {
+        fprintf(stderr, "Syntax: %s [-k] [-H] [-m serial|pool|epoll]\n"
+                "       %s -u [-H]\n"
+                "  -k   persistent connections with pipelined requests\n"
+                "  -u   serve requests over UDP instead of TCP\n"
+                "  -H   timestamps with millisecond resolution\n"
+                "  -m   how TCP connections are served (default: serial);\n"
+                "       with -k, pool serves at most %d clients at once\n", argv[0], argv[0], POOL_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    // replies are formatted by a background ticker, not per request
+    timecache_start(high_resolution);
+
+    if (udp) udp_server(); // does not return
+
+    struct sockaddr_in client_addr = {0};
+
+    /* Listening socket with a large backlog, TCP_DEFER_ACCEPT and TCP Fast
+     * Open as configured in common.h (see listener.c for the details) */
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 0,
+    };
+    socket_desc = listener_open(SERVER_PORT, &listen_opts);
 
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
+    if (!strcmp(mode, "pool"))  pool_server(socket_desc, persistent);   // does not return
+    if (!strcmp(mode, "epoll")) epoll_server(socket_desc, persistent);  // does not return
 
     // loop to handle incoming connections serially
     while (1) {
-        client_desc = accept(socket_desc, (struct sockaddr*) &client_addr, (socklen_t*) &sockaddr_len);
+        client_desc = listener_accept(socket_desc, &client_addr, SOCK_CLOEXEC);
         ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
 
         if (DEBUG) fprintf(stderr, "Incoming connection accepted...\n");
 
-        connection_handler(client_desc);
+        /* Note that with persistent connections a serial server can only
+         * talk with one client at a time, until that client disconnects */
+        if (persistent)
+            persistent_connection_handler(client_desc);
+        else
+            connection_handler(client_desc);
 
         if (DEBUG) fprintf(stderr, "Done!\n");
     }
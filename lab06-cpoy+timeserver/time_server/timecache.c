@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "timecache.h"
+
+/* Formatting a date is far more expensive than copying a few bytes, and
+ * ctime() returns a static buffer which is not safe with many threads.
+ * Since the text only changes once per tick, a ticker thread formats it
+ * and request handlers just copy it.
+ *
+ * Readers and the single writer are synchronized with a seqlock: the
+ * writer makes the sequence number odd while it updates the text and even
+ * again when done. A reader copies the text and retries if the sequence
+ * number was odd or changed meanwhile, so readers never wait for a lock
+ * and never slow the writer down. */
+static struct {
+    unsigned seq;
+    size_t   len;
+    char     text[TIMECACHE_MAX_LEN];
+} cache;
+
+static int high_res;
+
+static void format_time(const struct timespec* now, char* buf, size_t* len) {
+    struct tm tm;
+    localtime_r(&now->tv_sec, &tm);
+
+    // same layout as ctime(), optionally with milliseconds
+    if (high_res) {
+        char hms[16];
+        strftime(hms, sizeof(hms), "%H:%M:%S", &tm);
+        size_t n = strftime(buf, TIMECACHE_MAX_LEN, "%a %b %e ", &tm);
+        n += snprintf(buf + n, TIMECACHE_MAX_LEN - n, "%s.%03ld ", hms, now->tv_nsec / 1000000);
+        n += strftime(buf + n, TIMECACHE_MAX_LEN - n, "%Y\n", &tm);
+        *len = n;
+    } else {
+        *len = strftime(buf, TIMECACHE_MAX_LEN, "%a %b %e %H:%M:%S %Y\n", &tm);
+    }
+}
+
+static void update(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char text[TIMECACHE_MAX_LEN];
+    size_t len;
+    format_time(&now, text, &len); // format outside the write section
+
+    __atomic_store_n(&cache.seq, cache.seq + 1, __ATOMIC_RELAXED); // odd: update in progress
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(cache.text, text, len);
+    cache.len = len;
+    __atomic_store_n(&cache.seq, cache.seq + 1, __ATOMIC_RELEASE); // even: text is consistent
+}
+
+static void* ticker(void* arg) {
+    long tick = high_res ? 1000000L : 1000000000L;
+
+    while (1) {
+        /* sleep until the next tick boundary (an absolute deadline does
+         * not drift), so the text changes right when the time does */
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_nsec = (next.tv_nsec / tick + 1) * tick;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+        update();
+    }
+
+    return NULL;
+}
+
+void timecache_start(int high_resolution) {
+    high_res = high_resolution;
+    update(); // valid before the first request comes in
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, ticker, NULL);
+    PTHREAD_ERROR_HELPER(ret, "Cannot create the timestamp ticker thread");
+    pthread_detach(thread);
+}
+
+size_t timecache_read(char* buf) {
+    unsigned begin, end;
+    size_t len;
+
+    do {
+        begin = __atomic_load_n(&cache.seq, __ATOMIC_ACQUIRE);
+        len = cache.len;
+        memcpy(buf, cache.text, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&cache.seq, __ATOMIC_RELAXED);
+    } while ((begin & 1) || begin != end);
+
+    return len;
+}
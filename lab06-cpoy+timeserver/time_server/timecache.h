@@ -0,0 +1,19 @@
+#ifndef TIMECACHE_H
+#define TIMECACHE_H
+
+#include <stddef.h>
+
+#define TIMECACHE_MAX_LEN   64
+
+/* Start the background ticker that keeps the current time formatted like
+ * ctime() ("Sun Oct 18 10:51:10 2026\n"). The text is refreshed once per
+ * second or, when high_resolution is set, once per millisecond with the
+ * milliseconds added to the seconds ("10:51:10.123"). */
+void timecache_start(int high_resolution);
+
+/* Copy the current timestamp (newline included, no terminator) into buf,
+ * which must hold TIMECACHE_MAX_LEN bytes, and return its length. It never
+ * blocks and it is safe to call from any number of threads. */
+size_t timecache_read(char* buf);
+
+#endif
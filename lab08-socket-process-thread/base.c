@@ -9,92 +9,91 @@
 #include <sys/socket.h>
 
 #include "common.h"
+#include "bufpool.h"
+#include "echo_io.h"
+#include "listener.h"
 
 void connection_handler(int socket_desc, struct sockaddr_in* client_addr) {
     int ret, recv_bytes;
 
-    char buf[1024];
-    size_t buf_len = sizeof(buf);
-    size_t msg_len;
-
     char* quit_command = SERVER_COMMAND;
     size_t quit_command_len = strlen(quit_command);
 
+    /* the buffer grows with the messages of this client, and shrinks back
+     * when they get small again (see bufpool.c) */
+    echo_buf_t buf;
+    ret = echo_buf_init(&buf);
+    ERROR_HELPER(ret, "Cannot allocate a buffer for the connection");
+
     // parse client IP address and port
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
     uint16_t client_port = ntohs(client_addr->sin_port); // port number is an unsigned short
 
-    // send welcome message
-    sprintf(buf, "Hi! I'm an echo server. You are %s talking on port %hu.\nI will send you back whatever"
-            " you send me. I will stop if you send me %s :-)\n", client_ip, client_port, quit_command);
-    msg_len = strlen(buf);
-    while ( (ret = send(socket_desc, buf, msg_len, 0)) < 0 ) {
-        if (errno == EINTR) continue;
-        ERROR_HELPER(-1, "Cannot write to the socket");
-    }
+    /* send welcome message: a single sendmsg() gathers the static parts of
+     * the banner and the client's address (see echo_io.c) */
+    ret = echo_send_banner(socket_desc, client_ip, client_port);
+    ERROR_HELPER(ret, "Cannot write to the socket");
+
+    // large echoes are sent with MSG_ZEROCOPY, if enabled in common.h
+    zerocopy_t zc;
+    zerocopy_init(&zc, socket_desc, ZEROCOPY_THRESHOLD);
+
+    // bulk data is echoed with splice(), if enabled in common.h
+    splice_pipe_t sp;
+    splice_init(&sp, SPLICE_THRESHOLD);
 
     // echo loop
     while (1) {
         // read message from client
-        while ( (recv_bytes = recv(socket_desc, buf, buf_len, 0)) < 0 ) {
+        while ( (recv_bytes = recv(socket_desc, buf.data, buf.size, 0)) < 0 ) {
             if (errno == EINTR) continue;
             ERROR_HELPER(-1, "Cannot read from socket");
         }
 
         // check whether I have just been told to quit...
-        if (recv_bytes == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
+        if (recv_bytes == quit_command_len && !memcmp(buf.data, quit_command, quit_command_len)) break;
 
         // ... or if I have to send the message back
-        while ( (ret = send(socket_desc, buf, recv_bytes, 0)) < 0 ) {
-            if (errno == EINTR) continue;
-            ERROR_HELPER(-1, "Cannot write to the socket");
-        }
+        ret = echo_step(socket_desc, &zc, &sp, &buf, recv_bytes);
+        ERROR_HELPER(ret, "Cannot write to the socket");
     }
 
+    // wait for the MSG_ZEROCOPY sends before closing the socket and releasing the buffers
+    ret = zerocopy_flush(socket_desc, &zc);
+    ERROR_HELPER(ret, "Cannot write to the socket");
+    echo_buf_release(&buf);
+    if (DEBUG) zerocopy_print_stats(&zc, stderr);
+    if (DEBUG) splice_print_stats(&sp, stderr);
+    splice_close(&sp);
+
     // close socket
     ret = close(socket_desc);
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 }
 
 int main(int argc, char* argv[]) {
-    int ret;
-
     int socket_desc, client_desc;
 
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0};
-
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
-
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
-
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
-
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
-    int reuseaddr_opt = 1;
-    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
-    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
-
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
-
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
+    /* Listening socket with a large backlog and TCP Fast Open (see
+     * listener.c). TCP_DEFER_ACCEPT stays disabled: this server sends the
+     * banner first, so there is no request to wait for */
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 0,
+        .rcvbuf       = SOCKET_RCVBUF,
+        .sndbuf       = SOCKET_SNDBUF,
+    };
+    socket_desc = listener_open(SERVER_PORT, &listen_opts);
 
     // we allocate client_addr dynamically and initialize it to zero
     struct sockaddr_in* client_addr = calloc(1, sizeof(struct sockaddr_in));
 
     // loop to handle incoming connections serially
     while (1) {
-        client_desc = accept(socket_desc, (struct sockaddr*) client_addr, (socklen_t*) &sockaddr_len);
+        client_desc = listener_accept(socket_desc, client_addr, SOCK_CLOEXEC);
         if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
         ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
 
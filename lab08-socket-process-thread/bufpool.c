@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "bufpool.h"
+
+#define BUFPOOL_MAX_CLASSES 32
+
+/* A free buffer stores the link to the next one in its first bytes */
+typedef struct free_buf_s {
+    struct free_buf_s* next;
+} free_buf_t;
+
+static free_buf_t* free_lists[BUFPOOL_MAX_CLASSES];
+
+/* Slabs are carved lazily: each class remembers the next uncarved buffer
+ * of its current slab and how many are left. Linking a whole slab into
+ * the free list up front would write into every page of it, which a
+ * forked child serving one connection would pay for nothing. */
+static char* slab_next[BUFPOOL_MAX_CLASSES];
+static size_t slab_left[BUFPOOL_MAX_CLASSES];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// index of the smallest class holding size bytes, and size of that class
+static int size_class(size_t size, size_t* class_size) {
+    int idx = 0;
+    size_t s = ECHO_BUF_MIN_SIZE;
+    while (s < size) {
+        s <<= 1;
+        idx++;
+    }
+    if (class_size != NULL) *class_size = s;
+    return idx;
+}
+
+char* bufpool_get(size_t size) {
+    size_t buf_size;
+    int idx = size_class(size, &buf_size);
+
+    int ret = pthread_mutex_lock(&pool_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot lock the buffer pool");
+
+    char* buf = (char*) free_lists[idx];
+    if (buf != NULL) {
+        free_lists[idx] = free_lists[idx]->next;
+    } else {
+        if (slab_left[idx] == 0) {
+            // a new slab (at least one buffer) for this class
+            size_t count = buf_size < BUFPOOL_SLAB_SIZE ? BUFPOOL_SLAB_SIZE / buf_size : 1;
+            slab_next[idx] = malloc(count * buf_size);
+            if (slab_next[idx] != NULL) slab_left[idx] = count;
+        }
+        if (slab_left[idx] > 0) {
+            buf = slab_next[idx];
+            slab_next[idx] += buf_size;
+            slab_left[idx]--;
+        }
+    }
+
+    ret = pthread_mutex_unlock(&pool_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot unlock the buffer pool");
+
+    return buf;
+}
+
+void bufpool_put(char* buf, size_t size) {
+    int idx = size_class(size, NULL);
+    free_buf_t* b = (free_buf_t*) buf;
+
+    int ret = pthread_mutex_lock(&pool_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot lock the buffer pool");
+
+    b->next = free_lists[idx];
+    free_lists[idx] = b;
+
+    ret = pthread_mutex_unlock(&pool_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot unlock the buffer pool");
+}
+
+int echo_buf_init(echo_buf_t* buf) {
+    memset(buf, 0, sizeof(echo_buf_t));
+    buf->size = ECHO_BUF_MIN_SIZE;
+    buf->data = bufpool_get(buf->size);
+    if (buf->data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// swap the buffer for one of new_size bytes, unless memory is exhausted
+static void echo_buf_resize(echo_buf_t* buf, size_t new_size) {
+    char* data = bufpool_get(new_size);
+    if (data == NULL) return;
+    bufpool_put(buf->data, buf->size);
+    buf->data = data;
+    buf->size = new_size;
+}
+
+void echo_buf_adapt(echo_buf_t* buf, size_t received) {
+    // "filled" allows for a server that keeps one byte for a '\0'
+    if (received + 1 >= buf->size) {
+        buf->small_reads = 0;
+        // at least double it, or jump to the size of the whole burst
+        size_t new_size = buf->size * 2;
+        while (new_size <= received && new_size < ECHO_BUF_MAX_SIZE) new_size <<= 1;
+        if (new_size > ECHO_BUF_MAX_SIZE) new_size = ECHO_BUF_MAX_SIZE;
+        if (buf->size < ECHO_BUF_MAX_SIZE) echo_buf_resize(buf, new_size);
+    } else if (received < buf->size / 4) {
+        if (++buf->small_reads >= ECHO_BUF_SHRINK_AFTER && buf->size > ECHO_BUF_MIN_SIZE) {
+            echo_buf_resize(buf, buf->size / 2);
+            buf->small_reads = 0;
+        }
+    } else {
+        buf->small_reads = 0;
+    }
+}
+
+void echo_buf_release(echo_buf_t* buf) {
+    bufpool_put(buf->data, buf->size);
+    if (buf->spare != NULL) bufpool_put(buf->spare, buf->spare_size);
+    memset(buf, 0, sizeof(echo_buf_t));
+}
@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "connctx.h"
+
+typedef struct magazine_s {
+    int                 count;
+    conn_ctx_t*         ctxs[CONNCTX_MAGAZINE_SIZE];
+    struct magazine_s*  next;   // link in the depot's lists
+} magazine_t;
+
+/* The depot: full magazines for threads that ran out of contexts, spare
+ * empty ones for threads with a full magazine (or no magazine at all), and
+ * a partial one where the leftovers of exiting threads are gathered */
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static magazine_t* depot_full;
+static magazine_t* depot_empty;
+static magazine_t* depot_partial;
+
+// each thread keeps its magazine in a thread-specific data slot
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void depot_lock(void) {
+    int ret = pthread_mutex_lock(&depot_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot lock the context depot");
+}
+
+static void depot_unlock(void) {
+    int ret = pthread_mutex_unlock(&depot_mutex);
+    PTHREAD_ERROR_HELPER(ret, "Cannot unlock the context depot");
+}
+
+static void push(magazine_t** list, magazine_t* mag) {
+    mag->next = *list;
+    *list = mag;
+}
+
+static magazine_t* pop(magazine_t** list) {
+    magazine_t* mag = *list;
+    if (mag != NULL) *list = mag->next;
+    return mag;
+}
+
+// an empty magazine: a spare one from the depot or a new one (depot locked)
+static magazine_t* empty_magazine(void) {
+    magazine_t* mag = pop(&depot_empty);
+    if (mag == NULL) {
+        mag = calloc(1, sizeof(magazine_t));
+        if (mag == NULL) ERROR_HELPER(-1, "Cannot allocate a magazine of connection contexts");
+    }
+    return mag;
+}
+
+/* Destructor of the thread-specific slot, run when a thread exits: its
+ * contexts go to the depot's partial magazine, which joins the full ones
+ * once complete. With one thread per connection this happens once per
+ * connection, but it costs a single lock and no trip to malloc(). */
+static void cache_flush(void* arg) {
+    magazine_t* mag = (magazine_t*) arg;
+
+    depot_lock();
+    while (mag != NULL && mag->count > 0) {
+        if (depot_partial != NULL && depot_partial->count == CONNCTX_MAGAZINE_SIZE) {
+            push(&depot_full, depot_partial);
+            depot_partial = NULL;
+        }
+        if (depot_partial == NULL) {
+            depot_partial = mag; // the magazine itself becomes the partial one
+            mag = NULL;
+        } else {
+            depot_partial->ctxs[depot_partial->count++] = mag->ctxs[--mag->count];
+        }
+    }
+    if (mag != NULL) push(&depot_empty, mag);
+    depot_unlock();
+}
+
+static void create_cache_key(void) {
+    int ret = pthread_key_create(&cache_key, cache_flush);
+    PTHREAD_ERROR_HELPER(ret, "Cannot create the key for the context caches");
+}
+
+static magazine_t* thread_magazine(void) {
+    int ret = pthread_once(&cache_key_once, create_cache_key);
+    PTHREAD_ERROR_HELPER(ret, "Cannot create the key for the context caches");
+
+    magazine_t* mag = pthread_getspecific(cache_key);
+    if (mag == NULL) {
+        depot_lock();
+        mag = empty_magazine();
+        depot_unlock();
+
+        ret = pthread_setspecific(cache_key, mag);
+        PTHREAD_ERROR_HELPER(ret, "Cannot set the context cache of the thread");
+    }
+    return mag;
+}
+
+static void set_thread_magazine(magazine_t* mag) {
+    int ret = pthread_setspecific(cache_key, mag);
+    PTHREAD_ERROR_HELPER(ret, "Cannot set the context cache of the thread");
+}
+
+conn_ctx_t* conn_ctx_alloc(void) {
+    magazine_t* mag = thread_magazine();
+
+    if (mag->count == 0) {
+        // trade the empty magazine for one with contexts, if the depot has any
+        depot_lock();
+        magazine_t* loaded = pop(&depot_full);
+        if (loaded == NULL && depot_partial != NULL) {
+            loaded = depot_partial;
+            depot_partial = NULL;
+        }
+        if (loaded != NULL) {
+            push(&depot_empty, mag);
+            mag = loaded;
+        }
+        depot_unlock();
+        set_thread_magazine(mag);
+    }
+
+    if (mag->count == 0) {
+        // still nothing: carve a new slab into a magazine's worth of contexts
+        conn_ctx_t* slab = calloc(CONNCTX_MAGAZINE_SIZE, sizeof(conn_ctx_t));
+        if (slab == NULL) return NULL;
+        int i;
+        for (i = 0; i < CONNCTX_MAGAZINE_SIZE; i++) mag->ctxs[mag->count++] = &slab[i];
+    }
+
+    conn_ctx_t* ctx = mag->ctxs[--mag->count];
+
+    // the echo buffer stays with the context, everything else starts from zero
+    echo_buf_t buf = ctx->buf;
+    memset(ctx, 0, sizeof(conn_ctx_t));
+    ctx->buf = buf;
+    ctx->socket_desc = -1;
+
+    if (ctx->buf.data == NULL && echo_buf_init(&ctx->buf) < 0) {
+        mag->ctxs[mag->count++] = ctx;
+        return NULL;
+    }
+    return ctx;
+}
+
+void conn_ctx_free(conn_ctx_t* ctx) {
+    // buffers grown by a bulk transfer, or doubled for MSG_ZEROCOPY, go back to the pool
+    if (ctx->buf.data != NULL && (ctx->buf.size != ECHO_BUF_MIN_SIZE || ctx->buf.spare != NULL))
+        echo_buf_release(&ctx->buf);
+    ctx->buf.small_reads = 0;
+
+    magazine_t* mag = thread_magazine();
+    if (mag->count == CONNCTX_MAGAZINE_SIZE) {
+        // trade the full magazine for an empty one
+        depot_lock();
+        push(&depot_full, mag);
+        mag = empty_magazine();
+        depot_unlock();
+        set_thread_magazine(mag);
+    }
+    mag->ctxs[mag->count++] = ctx;
+}
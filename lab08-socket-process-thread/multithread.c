@@ -1,8 +1,10 @@
+#define _GNU_SOURCE // CPU affinity macros
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>   // sched_getaffinity()
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>  // htons()
@@ -10,28 +12,22 @@
 #include <sys/socket.h>
 
 #include "common.h"
-
-typedef struct handler_args_s {
-    int socket_desc;
-    struct sockaddr_in* client_addr;
-} handler_args_t;
+#include "connctx.h"
+#include "echo_io.h"
+#include "listener.h"
 
 void* connection_handler(void* arg) {
-    handler_args_t* args = (handler_args_t*)arg;
+    conn_ctx_t* ctx = (conn_ctx_t*)arg;
 
     /* We make local copies of the fields from the handler's arguments
      * data structure only to share as much code as possible with the
      * other two versions of the server. In general this is not a good
      * coding practice: using simple indirection is better! */
-    int socket_desc = args->socket_desc;
-    struct sockaddr_in* client_addr = args->client_addr;
+    int socket_desc = ctx->socket_desc;
+    struct sockaddr_in* client_addr = &ctx->client_addr;
 
     int ret, recv_bytes;
 
-    char buf[1024];
-    size_t buf_len = sizeof(buf);
-    size_t msg_len;
-
     char* quit_command = SERVER_COMMAND;
     size_t quit_command_len = strlen(quit_command);
 
@@ -40,83 +36,64 @@ void* connection_handler(void* arg) {
     inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
     uint16_t client_port = ntohs(client_addr->sin_port); // port number is an unsigned short
 
-    // send welcome message
-    sprintf(buf, "Hi! I'm an echo server. You are %s talking on port %hu.\nI will send you back whatever"
-            " you send me. I will stop if you send me %s :-)\n", client_ip, client_port, quit_command);
-    msg_len = strlen(buf);
-    while ( (ret = send(socket_desc, buf, msg_len, 0)) < 0 ) {
-        if (errno == EINTR) continue;
-        ERROR_HELPER(-1, "Cannot write to the socket");
-    }
+    /* send welcome message: a single sendmsg() gathers the static parts of
+     * the banner and the client's address (see echo_io.c) */
+    ret = echo_send_banner(socket_desc, client_ip, client_port);
+    ERROR_HELPER(ret, "Cannot write to the socket");
+
+    // large echoes are sent with MSG_ZEROCOPY, if enabled in common.h
+    zerocopy_init(&ctx->zc, socket_desc, ZEROCOPY_THRESHOLD);
+
+    // bulk data is echoed with splice(), if enabled in common.h
+    splice_init(&ctx->sp, SPLICE_THRESHOLD);
 
     // echo loop
     while (1) {
         // read message from client
-        while ( (recv_bytes = recv(socket_desc, buf, buf_len, 0)) < 0 ) {
+        while ( (recv_bytes = recv(socket_desc, ctx->buf.data, ctx->buf.size, 0)) < 0 ) {
             if (errno == EINTR) continue;
             ERROR_HELPER(-1, "Cannot read from socket");
         }
 
         // check whether I have just been told to quit...
-        if (recv_bytes == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
+        if (recv_bytes == quit_command_len && !memcmp(ctx->buf.data, quit_command, quit_command_len)) break;
 
         // ... or if I have to send the message back
-        while ( (ret = send(socket_desc, buf, recv_bytes, 0)) < 0 ) {
-            if (errno == EINTR) continue;
-            ERROR_HELPER(-1, "Cannot write to the socket");
-        }
+        ret = echo_step(socket_desc, &ctx->zc, &ctx->sp, &ctx->buf, recv_bytes);
+        ERROR_HELPER(ret, "Cannot write to the socket");
     }
 
+    // wait for the MSG_ZEROCOPY sends before closing the socket and releasing the buffers
+    ret = zerocopy_flush(ctx->socket_desc, &ctx->zc);
+    ERROR_HELPER(ret, "Cannot write to the socket");
+    if (DEBUG) zerocopy_print_stats(&ctx->zc, stderr);
+    if (DEBUG) splice_print_stats(&ctx->sp, stderr);
+    splice_close(&ctx->sp);
+
     // close socket
     ret = close(socket_desc);
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 
     if (DEBUG) fprintf(stderr, "Thread created to handle the request has completed.\n");
 
-    free(args->client_addr); // do not forget to free this buffer!
-    free(args);
+    conn_ctx_free(ctx); // back to this thread's cache (see connctx.c)
     pthread_exit(NULL);
 }
 
-int main(int argc, char* argv[]) {
-    int ret;
-
-    int socket_desc, client_desc;
-
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0};
-
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
-
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
-
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
-
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
-    int reuseaddr_opt = 1;
-    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
-    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
+/* Accept loop: the whole server runs one of these, or one per CPU in
+ * sharded mode (see shard_acceptor() below) */
+void accept_loop(int socket_desc) {
+    int ret, client_desc;
 
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
-
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
-
-    // we allocate client_addr dynamically and initialize it to zero
-    struct sockaddr_in* client_addr = calloc(1, sizeof(struct sockaddr_in));
+    /* each connection gets a context from the slab (see connctx.c) with its
+     * address, descriptor, buffers and stats, all in a single object */
+    conn_ctx_t* ctx = conn_ctx_alloc();
+    if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
 
     // loop to manage incoming connections spawning handler threads
     while (1) {
         // accept incoming connection
-        client_desc = accept(socket_desc, (struct sockaddr*) client_addr, (socklen_t*) &sockaddr_len);
+        client_desc = listener_accept(socket_desc, &ctx->client_addr, SOCK_CLOEXEC);
         if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
         ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
 
@@ -124,12 +101,10 @@ int main(int argc, char* argv[]) {
 
         pthread_t thread;
 
-        // put arguments for the new thread into a buffer
-        handler_args_t* thread_args = malloc(sizeof(handler_args_t));
-        thread_args->socket_desc = client_desc;
-        thread_args->client_addr = client_addr;
+        // the context is the argument of the new thread
+        ctx->socket_desc = client_desc;
 
-        ret = pthread_create(&thread, NULL, connection_handler, (void*)thread_args);
+        ret = pthread_create(&thread, NULL, connection_handler, (void*)ctx);
         PTHREAD_ERROR_HELPER(ret, "Could not create a new thread");            
 
         if (DEBUG) fprintf(stderr, "New thread created to handle the request!\n");
@@ -137,8 +112,78 @@ int main(int argc, char* argv[]) {
         ret = pthread_detach(thread); // I won't phtread_join() on this thread
         PTHREAD_ERROR_HELPER(ret, "Could not detach the thread");            
         
-        // we can't just reset fields: we need a new buffer for client_addr!
-        client_addr = calloc(1, sizeof(struct sockaddr_in));
+        // the handler owns the context now: we need a new one for the next connection
+        ctx = conn_ctx_alloc();
+        if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
+    }
+}
+
+/* In sharded mode each CPU has its own acceptor thread, pinned to it, with
+ * its own SO_REUSEPORT listening socket: the kernel spreads connections
+ * among the sockets, so acceptors never contend on a shared accept queue,
+ * and the handler threads inherit the acceptor's CPU affinity */
+void* shard_acceptor(void* arg) {
+    int cpu = (int)(long)arg;
+
+    int ret = listener_pin_to_cpu(cpu);
+    ERROR_HELPER(ret, "Cannot pin acceptor thread to its CPU");
+
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 1,
+        .rcvbuf       = SOCKET_RCVBUF,
+        .sndbuf       = SOCKET_SNDBUF,
+    };
+    int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+    if (DEBUG) fprintf(stderr, "Acceptor for CPU %d is listening...\n", cpu);
+
+    accept_loop(socket_desc);
+    return NULL; // never reached
+}
+
+int main(int argc, char* argv[]) {
+    int ret;
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--sharded"))) {
+        fprintf(stderr, "Syntax: %s [--sharded]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc == 2) {
+        // one acceptor for each CPU we are allowed to run on
+        cpu_set_t cpus;
+        ret = sched_getaffinity(0, sizeof(cpus), &cpus);
+        ERROR_HELPER(ret, "Cannot get the CPU affinity of the server");
+
+        pthread_t acceptors[CPU_SETSIZE];
+        int num_acceptors = 0;
+        for (long cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &cpus)) continue;
+            ret = pthread_create(&acceptors[num_acceptors++], NULL, shard_acceptor, (void*)cpu);
+            PTHREAD_ERROR_HELPER(ret, "Could not create an acceptor thread");
+        }
+
+        for (int i = 0; i < num_acceptors; i++) {
+            ret = pthread_join(acceptors[i], NULL);
+            PTHREAD_ERROR_HELPER(ret, "Could not join an acceptor thread");
+        }
+    } else {
+        /* Large backlog and TCP Fast Open; TCP_DEFER_ACCEPT is off
+         * because the banner goes out before the client sends anything */
+        listener_opts_t listen_opts = {
+            .backlog      = MAX_CONN_QUEUE,
+            .defer_accept = DEFER_ACCEPT_SECS,
+            .fastopen     = FASTOPEN_QUEUE,
+            .reuseport    = 0,
+            .rcvbuf       = SOCKET_RCVBUF,
+            .sndbuf       = SOCKET_SNDBUF,
+        };
+        int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+        accept_loop(socket_desc);
     }
 
     exit(EXIT_SUCCESS); // this will never be executed
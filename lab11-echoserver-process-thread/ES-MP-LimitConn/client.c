@@ -47,6 +47,12 @@ int main(int argc, char* argv[]) {
     buf[msg_len] = '\0';
     printf("%s", buf);
 
+    // an overloaded server answers with a busy message and hangs up
+    if (!strncmp(buf, "BUSY", 4)) {
+        close(socket_desc);
+        exit(EXIT_FAILURE);
+    }
+
     // main loop
     while (1) {
         char* quit_command = SERVER_COMMAND;
@@ -14,11 +14,55 @@
 
 /* Configuration parameters */
 #define DEBUG           1   // display debug messages
-#define MAX_CONN_QUEUE  3   // max number of connections the server can queue
+#define MAX_CONN_QUEUE  1024    // max number of connections the server can queue
+/* The server speaks first (welcome message), so TCP_DEFER_ACCEPT would
+ * only hold back connections until its timeout: keep it disabled */
+#define DEFER_ACCEPT_SECS   0
+#define FASTOPEN_QUEUE      256 // pending TCP Fast Open requests, 0 disables it
 #define SERVER_ADDRESS  "127.0.0.1"
 #define SERVER_COMMAND  "QUIT"
 #define SERVER_PORT     2015
+
+/* Echoes of at least ZEROCOPY_THRESHOLD bytes are sent with MSG_ZEROCOPY
+ * (0 disables it): below ~10 KB pinning the pages costs more than the copy
+ * it saves. */
+#define ZEROCOPY_THRESHOLD  16384
+
+/* When a recv() fills the echo buffer, the bytes already queued behind
+ * it are echoed with splice() through a pipe, without copying them into
+ * the server's buffer, if there are at least SPLICE_THRESHOLD of them
+ * (0 disables it). Everything else takes the usual path, so the server
+ * still sees the quit command. */
+#define SPLICE_THRESHOLD    4096
+
+/* Echo buffers (see bufpool.c): each connection starts with
+ * ECHO_BUF_MIN_SIZE bytes and doubles its buffer, up to ECHO_BUF_MAX_SIZE,
+ * while the client keeps filling it */
+#define ECHO_BUF_MIN_SIZE       1024
+#define ECHO_BUF_MAX_SIZE       65536
+#define ECHO_BUF_SHRINK_AFTER   16  // small reads in a row before halving it
+
+/* Kernel buffers of each connection in bytes (0 keeps the default, which
+ * the kernel tunes automatically). They are set on the listening socket,
+ * so accepted sockets have them from the handshake on. */
+#define SOCKET_RCVBUF   0
+#define SOCKET_SNDBUF   0
 #define MAX_CONCURRENCY 3   // max number of connections to process in parallel
 #define SEMAPHORE_NAME  "/srv_concurrency"  // name for the named semaphore
 
+/* Admission of new connections when MAX_CONCURRENCY of them are being served:
+ * the accept loop waits at most ADMISSION_WAIT_MS for a free slot (0 means
+ * "don't wait at all", -1 restores the old blocking behavior), then answers
+ * with BUSY_REPLY and closes the connection, so it can keep accepting. */
+#define ADMISSION_WAIT_MS   0
+#define BUSY_REPLY          "BUSY: too many connections, try again later\n"
+
+/* Rate limiting of echoed messages (see ratelimit.c) */
+#define GLOBAL_RATE             1000    // messages per second, all clients together
+#define GLOBAL_RATE_BURST       200     // messages accepted at once after an idle period
+#define CLIENT_RATE             50      // messages per second for each client address
+#define CLIENT_RATE_BURST       20
+#define RATE_LIMIT_MAX_DELAY_MS 50      // messages that would wait longer are rejected
+#define RATE_LIMIT_REPLY        "BUSY: rate limit exceeded, message dropped\n"
+
 #endif
@@ -0,0 +1,34 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdint.h>
+#include <netinet/in.h> // struct sockaddr_in
+
+/* Options for the listening socket of a TCP server. A zero field leaves the
+ * corresponding feature disabled. */
+typedef struct listener_opts_s {
+    int backlog;        // length of the accept queue (capped by net.core.somaxconn)
+    int defer_accept;   // seconds TCP_DEFER_ACCEPT waits for the client's first bytes
+    int fastopen;       // max number of pending TCP Fast Open requests
+    int reuseport;      // allow other sockets to bind the same port (SO_REUSEPORT)
+    int rcvbuf;         // SO_RCVBUF of the accepted connections, in bytes
+    int sndbuf;         // SO_SNDBUF of the accepted connections, in bytes
+} listener_opts_t;
+
+/* Create a TCP socket listening on the given port on all interfaces.
+ * Socket creation, bind() and listen() errors are fatal; options the
+ * kernel does not support only produce a warning. */
+int listener_open(uint16_t port, const listener_opts_t* opts);
+
+/* Accept a connection with accept4(), applying flags (SOCK_CLOEXEC,
+ * SOCK_NONBLOCK) to the new descriptor. Connections aborted by the client
+ * while still in the queue are skipped; on any other error it returns -1
+ * with errno set, like accept(). */
+int listener_accept(int listen_desc, struct sockaddr_in* client_addr, int flags);
+
+/* Pin the calling thread to the given CPU, so that a sharded server can
+ * keep each acceptor (and the handlers it creates) on its own core.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int listener_pin_to_cpu(int cpu);
+
+#endif
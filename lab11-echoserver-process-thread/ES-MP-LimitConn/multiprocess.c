@@ -14,11 +14,17 @@
 #include <sys/syscall.h> // gettid()
 
 #include "common.h" // MAX_CONCURRENCY, ERROR_HELPER and other macros
+#include "bufpool.h"
+#include "echo_io.h"
+#include "listener.h"
+#include "ratelimit.h"
 
 /** Global data **/
 pid_t   main_process;
 /* ===> SOLUTION <=== */
 sem_t*  connections;
+rate_limiter_t* limiter; // in shared memory, thus shared with the children
+unsigned long rejected_connections = 0; // only updated by the main process
 
 /** Method is executed by the main process and all of its children
  *  when a SIGINT or SIGTERM signal is received. **/
@@ -38,6 +44,10 @@ void signalHandlerCleanup(int sig_no) {
         ret = sem_unlink(SEMAPHORE_NAME);
         ERROR_HELPER(ret, "[MAIN PROCESS] Cannot unlink named semaphore");
 
+        rate_limiter_print_stats(limiter, stderr);
+        rate_limiter_destroy(limiter);
+
+        fprintf(stderr, "[MAIN PROCESS] %lu connections rejected because of overload\n", rejected_connections);
         fprintf(stderr, "[MAIN PROCESS] Main process terminated gracefully\n");
     } else {
         // nothing to do for child processes
@@ -47,6 +57,45 @@ void signalHandlerCleanup(int sig_no) {
     exit(EXIT_SUCCESS);
 }
 
+/** Try to take a slot on the semaphore limiting the degree of concurrency,
+ *  waiting at most ADMISSION_WAIT_MS. Returns 1 on success, 0 when the
+ *  server is overloaded and the connection should be rejected. **/
+int admit_connection(sem_t* sem) {
+    int ret;
+    struct timespec deadline;
+
+    if (ADMISSION_WAIT_MS > 0) {
+        // sem_timedwait() wants an absolute time on CLOCK_REALTIME
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += ADMISSION_WAIT_MS / 1000;
+        deadline.tv_nsec += (ADMISSION_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (1) {
+        if (ADMISSION_WAIT_MS < 0)       ret = sem_wait(sem);
+        else if (ADMISSION_WAIT_MS == 0) ret = sem_trywait(sem);
+        else                             ret = sem_timedwait(sem, &deadline);
+
+        if (ret == 0) return 1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == ETIMEDOUT) return 0;
+        ERROR_HELPER(-1, "Wait on semaphore failed");
+    }
+}
+
+/** Tell an overloaded client to come back later and hang up. The reply is
+ *  tiny and the socket buffer of a fresh connection is empty, so a single
+ *  non-blocking send() is enough: if it fails we just close. **/
+void reject_connection(int socket_desc) {
+    send(socket_desc, BUSY_REPLY, strlen(BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL);
+    int ret = close(socket_desc);
+    ERROR_HELPER(ret, "Cannot close rejected connection");
+}
+
 /* Method executed by threads created to handle incoming connections */
 void connection_handler(int socket_desc, struct sockaddr_in* client_addr) {
     // retrieve PID for child process
@@ -54,13 +103,15 @@ void connection_handler(int socket_desc, struct sockaddr_in* client_addr) {
 
     int ret, recv_bytes;
 
-    char buf[1024];
-    size_t buf_len = sizeof(buf);
-    int msg_len;
-
     char* quit_command = SERVER_COMMAND;
     size_t quit_command_len = strlen(quit_command);
 
+    /* the buffer grows with the messages of this client, and shrinks back
+     * when they get small again (see bufpool.c) */
+    echo_buf_t buf;
+    ret = echo_buf_init(&buf);
+    ERROR_HELPER(ret, "Cannot allocate a buffer for the connection");
+
     // parse client IP address and port
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
@@ -69,23 +120,24 @@ void connection_handler(int socket_desc, struct sockaddr_in* client_addr) {
     // message for the log file
     fprintf(stderr, "[PROCESS %u] Handling connection from %s on port %hu...\n", process_id, client_ip, client_port);
 
-    // send welcome message
-    sprintf(buf, "Hi! I'm an echo server. You are %s talking on port %hu.\nI will send you back whatever"
-            " you send me. I will stop if you send me %s :-)\n", client_ip, client_port, quit_command);
-    msg_len = strlen(buf);
-    int bytes_sent = 0;
-    while (bytes_sent < msg_len) {
-        ret = send(socket_desc, buf+bytes_sent, msg_len-bytes_sent, 0);
-        if (ret == 1 && errno == EINTR) continue;
-        ERROR_HELPER(ret, "Cannot write to socket");
-        bytes_sent += ret;
-    }
+    /* send welcome message: a single sendmsg() gathers the static parts of
+     * the banner and the client's address (see echo_io.c) */
+    ret = echo_send_banner(socket_desc, client_ip, client_port);
+    ERROR_HELPER(ret, "Cannot write to socket");
+
+    // large echoes are sent with MSG_ZEROCOPY, if enabled in common.h
+    zerocopy_t zc;
+    zerocopy_init(&zc, socket_desc, ZEROCOPY_THRESHOLD);
+
+    // bulk data is echoed with splice(), if enabled in common.h
+    splice_pipe_t sp;
+    splice_init(&sp, SPLICE_THRESHOLD);
 
     // echo loop
     while (1) {
         // read message from client
         // (best-effort implementation: we don't have a message delimiter)
-        while ( (recv_bytes = recv(socket_desc, buf, buf_len, 0)) <= 0 ) {
+        while ( (recv_bytes = recv(socket_desc, buf.data, buf.size, 0)) <= 0 ) {
             if (recv_bytes == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
             
             // if we get here we know that ret == -1
@@ -94,23 +146,34 @@ void connection_handler(int socket_desc, struct sockaddr_in* client_addr) {
         }
 
         // check whether I have just been told to quit...
-        if (recv_bytes == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
-
-        // ... or if I have to send the message back
-        bytes_sent = 0;
-        while (bytes_sent < recv_bytes) {
-            ret = send(socket_desc, buf+bytes_sent, recv_bytes-bytes_sent, 0);
-            if (ret == 1 && errno == EINTR) continue;
-            ERROR_HELPER(ret, "Cannot write to socket");
-            bytes_sent += ret;
+        if (recv_bytes == quit_command_len && !memcmp(buf.data, quit_command, quit_command_len)) break;
+
+        /* ... or if I have to send the message back: messages beyond
+         * the rate limits are delayed, or dropped with a busy reply */
+        int verdict = rate_limiter_admit(limiter, client_addr->sin_addr.s_addr);
+        if (verdict == RL_REJECTED) {
+            ret = echo_send(socket_desc, &zc, RATE_LIMIT_REPLY, strlen(RATE_LIMIT_REPLY));
+            echo_buf_adapt(&buf, recv_bytes);
+        } else {
+            ret = echo_step(socket_desc, &zc, &sp, &buf, recv_bytes);
         }
+        ERROR_HELPER(ret, "Cannot write to socket");
     }
 
+    // wait for the MSG_ZEROCOPY sends before closing the socket and releasing the buffers
+    ret = zerocopy_flush(socket_desc, &zc);
+    ERROR_HELPER(ret, "Cannot write to socket");
+    echo_buf_release(&buf);
+    if (DEBUG) zerocopy_print_stats(&zc, stderr);
+    if (DEBUG) splice_print_stats(&sp, stderr);
+    splice_close(&sp);
+
     // close socket
     ret = close(socket_desc);
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 
     fprintf(stderr, "[PROCESS %u] Connection with %s on port %hu closed.\n", process_id, client_ip, client_port);
+    if (DEBUG) rate_limiter_print_stats(limiter, stderr);
 
     /* ===> SOLUTION <=== */
     /** Process is about to exit, thus we can update the semaphore **/
@@ -142,6 +205,10 @@ int main(int argc, char* argv[]) {
         ERROR_HELPER(-1, "Cannot open named semaphore");
     }
 
+    // the rate limiter must exist before we fork any child
+    limiter = rate_limiter_create();
+    if (limiter == NULL) ERROR_HELPER(-1, "Cannot create rate limiter");
+
     /** Here we set up a handler for SIGTERM and SIGINT signals: this
      *  will allow the server to cleanup before exiting. Note that we
      *  store the process ID of the main process in a global variable,
@@ -156,32 +223,17 @@ int main(int argc, char* argv[]) {
     ret = sigaction(SIGINT, &action, NULL);
     ERROR_HELPER(ret, "Cannot set up handler for SIGINT");
 
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0};
-
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
-
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
-
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
-
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
-    int reuseaddr_opt = 1;
-    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
-    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
-
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
-
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
+    /* Large backlog and TCP Fast Open (see listener.c). The banner is
+     * sent first, so TCP_DEFER_ACCEPT is disabled in common.h */
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 0,
+        .rcvbuf       = SOCKET_RCVBUF,
+        .sndbuf       = SOCKET_SNDBUF,
+    };
+    socket_desc = listener_open(SERVER_PORT, &listen_opts);
 
     // print server boot message
     time_t curr_time;
@@ -194,17 +246,25 @@ int main(int argc, char* argv[]) {
     // loop to manage incoming connections spawning handler threads
     while (1) {
         // accept incoming connection
-        client_desc = accept(socket_desc, (struct sockaddr*) client_addr, (socklen_t*) &sockaddr_len);
+        client_desc = listener_accept(socket_desc, client_addr, SOCK_CLOEXEC);
         if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
         ERROR_HELPER(client_desc, "[MAIN PROCESS] Cannot open socket for incoming connection");
 
         if (DEBUG) fprintf(stderr, "[MAIN PROCESS] Incoming connection accepted\n");
 
         /* ===> SOLUTION <=== */
-        /** We don't want to create more than MAX_CONCURRENCY child processes **/
-        ret = sem_wait(connections);
-        ERROR_HELPER(ret, "Wait on named semaphore failed");
-        
+        /** We don't want to create more than MAX_CONCURRENCY child processes.
+         *  Rather than blocking here (which stops accept() and lets the
+         *  listen queue overflow), we turn excess clients away at once. **/
+        if (!admit_connection(connections)) {
+            reject_connection(client_desc);
+            rejected_connections++;
+            if (DEBUG) fprintf(stderr, "[MAIN PROCESS] Server busy, connection rejected\n");
+            memset(client_addr, 0, sizeof(struct sockaddr_in));
+            continue;
+        }
+
+
         pid_t pid = fork();
         if (pid == -1) {
             ERROR_HELPER(-1, "[MAIN PROCESS] Cannot fork to handle the request");
@@ -1,6 +1,8 @@
+#define _GNU_SOURCE // CPU affinity macros
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>   // sched_getaffinity()
 #include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
@@ -14,9 +16,15 @@
 #include <sys/syscall.h> // gettid()
 
 #include "common.h" // MAX_CONCURRENCY, ERROR_HELPER and other macros
+#include "connctx.h"
+#include "echo_io.h"
+#include "listener.h"
+#include "ratelimit.h"
 
 /** Global data **/
 sem_t connections;
+rate_limiter_t* limiter;
+unsigned long rejected_connections = 0; // updated atomically by the acceptor(s)
 
 /** Method executed by the server when it receives a INT or TERM signal **/
 void signalHandlerCleanup(int sig_no) {
@@ -27,19 +35,56 @@ void signalHandlerCleanup(int sig_no) {
     int ret = sem_destroy(&connections);
     ERROR_HELPER(ret, "Cannot destroy semaphore");
 
+    rate_limiter_print_stats(limiter, stderr);
+    rate_limiter_destroy(limiter);
+
+    fprintf(stderr, "%lu connections rejected because of overload\n", rejected_connections);
     fprintf(stderr, "Success!\n");
     exit(EXIT_SUCCESS);
 }
 
-/* Data structure to encapsulate arguments for handler threads */
-typedef struct handler_args_s {
-    int socket_desc;
-    struct sockaddr_in* client_addr;
-} handler_args_t;
+/** Try to take a slot on the semaphore limiting the degree of concurrency,
+ *  waiting at most ADMISSION_WAIT_MS. Returns 1 on success, 0 when the
+ *  server is overloaded and the connection should be rejected. **/
+int admit_connection(sem_t* sem) {
+    int ret;
+    struct timespec deadline;
+
+    if (ADMISSION_WAIT_MS > 0) {
+        // sem_timedwait() wants an absolute time on CLOCK_REALTIME
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += ADMISSION_WAIT_MS / 1000;
+        deadline.tv_nsec += (ADMISSION_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (1) {
+        if (ADMISSION_WAIT_MS < 0)       ret = sem_wait(sem);
+        else if (ADMISSION_WAIT_MS == 0) ret = sem_trywait(sem);
+        else                             ret = sem_timedwait(sem, &deadline);
+
+        if (ret == 0) return 1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == ETIMEDOUT) return 0;
+        ERROR_HELPER(-1, "Wait on semaphore failed");
+    }
+}
+
+/** Tell an overloaded client to come back later and hang up. The reply is
+ *  tiny and the socket buffer of a fresh connection is empty, so a single
+ *  non-blocking send() is enough: if it fails we just close. **/
+void reject_connection(int socket_desc) {
+    send(socket_desc, BUSY_REPLY, strlen(BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL);
+    int ret = close(socket_desc);
+    ERROR_HELPER(ret, "Cannot close rejected connection");
+}
 
 /* Method executed by threads created to handle incoming connections */
 void* connection_handler(void* arg) {
-    handler_args_t* args = (handler_args_t*)arg;
+    conn_ctx_t* ctx = (conn_ctx_t*)arg;
 
     // retrieve current thread's ID (TID is unique in the system)
     pid_t thread_id = syscall(SYS_gettid);
@@ -48,15 +93,11 @@ void* connection_handler(void* arg) {
      * data structure only to share as much code as possible with the
      * other two versions of the server. In general this is not a good
      * coding practice: using simple indirection is better! */
-    int socket_desc = args->socket_desc;
-    struct sockaddr_in* client_addr = args->client_addr;
+    int socket_desc = ctx->socket_desc;
+    struct sockaddr_in* client_addr = &ctx->client_addr;
 
     int ret, recv_bytes;
 
-    char buf[1024];
-    size_t buf_len = sizeof(buf);
-    int msg_len;
-
     char* quit_command = SERVER_COMMAND;
     size_t quit_command_len = strlen(quit_command);
 
@@ -68,23 +109,22 @@ void* connection_handler(void* arg) {
     // message for the log file
     fprintf(stderr, "[THREAD %u] Handling connection from %s on port %hu...\n", thread_id, client_ip, client_port);
 
-    // send welcome message
-    sprintf(buf, "Hi! I'm an echo server. You are %s talking on port %hu.\nI will send you back whatever"
-            " you send me. I will stop if you send me %s :-)\n", client_ip, client_port, quit_command);
-    msg_len = strlen(buf);
-    int bytes_sent = 0;
-    while (bytes_sent < msg_len) {
-        ret = send(socket_desc, buf+bytes_sent, msg_len-bytes_sent, 0);
-        if (ret == 1 && errno == EINTR) continue;
-        ERROR_HELPER(ret, "Cannot write to socket");
-        bytes_sent += ret;
-    }
+    /* send welcome message: a single sendmsg() gathers the static parts of
+     * the banner and the client's address (see echo_io.c) */
+    ret = echo_send_banner(socket_desc, client_ip, client_port);
+    ERROR_HELPER(ret, "Cannot write to socket");
+
+    // large echoes are sent with MSG_ZEROCOPY, if enabled in common.h
+    zerocopy_init(&ctx->zc, socket_desc, ZEROCOPY_THRESHOLD);
+
+    // bulk data is echoed with splice(), if enabled in common.h
+    splice_init(&ctx->sp, SPLICE_THRESHOLD);
 
     // echo loop
     while (1) {
         // read message from client
         // (best-effort implementation: we don't have a message delimiter)
-        while ( (recv_bytes = recv(socket_desc, buf, buf_len, 0)) <= 0 ) {
+        while ( (recv_bytes = recv(socket_desc, ctx->buf.data, ctx->buf.size, 0)) <= 0 ) {
             if (recv_bytes == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
             
             // if we get here we know that ret == -1
@@ -93,38 +133,123 @@ void* connection_handler(void* arg) {
         }
 
         // check whether I have just been told to quit...
-        if (recv_bytes == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
-
-        // ... or if I have to send the message back
-        bytes_sent = 0;
-        while (bytes_sent < recv_bytes) {
-            ret = send(socket_desc, buf+bytes_sent, recv_bytes-bytes_sent, 0);
-            if (ret == 1 && errno == EINTR) continue;
-            ERROR_HELPER(ret, "Cannot write to socket");
-            bytes_sent += ret;
+        if (recv_bytes == quit_command_len && !memcmp(ctx->buf.data, quit_command, quit_command_len)) break;
+
+        /* ... or if I have to send the message back: messages beyond
+         * the rate limits are delayed, or dropped with a busy reply */
+        int verdict = rate_limiter_admit(limiter, client_addr->sin_addr.s_addr);
+        if (verdict == RL_REJECTED) {
+            ret = echo_send(socket_desc, &ctx->zc, RATE_LIMIT_REPLY, strlen(RATE_LIMIT_REPLY));
+            echo_buf_adapt(&ctx->buf, recv_bytes);
+        } else {
+            ret = echo_step(socket_desc, &ctx->zc, &ctx->sp, &ctx->buf, recv_bytes);
         }
+        ERROR_HELPER(ret, "Cannot write to socket");
     }
 
+    // wait for the MSG_ZEROCOPY sends before closing the socket and releasing the buffers
+    ret = zerocopy_flush(ctx->socket_desc, &ctx->zc);
+    ERROR_HELPER(ret, "Cannot write to socket");
+    if (DEBUG) zerocopy_print_stats(&ctx->zc, stderr);
+    if (DEBUG) splice_print_stats(&ctx->sp, stderr);
+    splice_close(&ctx->sp);
+
     // close socket
     ret = close(socket_desc);
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 
     fprintf(stderr, "[THREAD %u] Connection with %s on port %hu closed.\n", thread_id, client_ip, client_port);
+    if (DEBUG) rate_limiter_print_stats(limiter, stderr);
 
     /* ===> SOLUTION <=== */
     /** Thread is about to exit, thus we can update the semaphore **/
     ret = sem_post(&connections);
     ERROR_HELPER(ret, "Post on semaphore failed");
 
-    free(args->client_addr);
-    free(args);
+    conn_ctx_free(ctx); // back to this thread's cache (see connctx.c)
     pthread_exit(NULL);
 }
 
+/* Accept loop: the whole server runs one of these, or one per CPU in
+ * sharded mode (see shard_acceptor() below) */
+void accept_loop(int socket_desc) {
+    int ret, client_desc;
+
+    /* each connection gets a context from the slab (see connctx.c) with its
+     * address, descriptor, buffers and stats, all in a single object */
+    conn_ctx_t* ctx = conn_ctx_alloc();
+    if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
+
+    // loop to manage incoming connections spawning handler threads
+    while (1) {
+        // accept incoming connection
+        client_desc = listener_accept(socket_desc, &ctx->client_addr, SOCK_CLOEXEC);
+        if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
+        ERROR_HELPER(client_desc, "[ACCEPTOR] Cannot open socket for incoming connection");
+
+        if (DEBUG) fprintf(stderr, "[ACCEPTOR] Incoming connection accepted\n");
+
+        /* ===> SOLUTION <=== */
+        /** We don't want to create more than MAX_CONCURRENCY threads: excess
+         *  clients are turned away at once instead of blocking accept() **/
+        if (!admit_connection(&connections)) {
+            reject_connection(client_desc);
+            __sync_fetch_and_add(&rejected_connections, 1);
+            if (DEBUG) fprintf(stderr, "[ACCEPTOR] Server busy, connection rejected\n");
+            memset(&ctx->client_addr, 0, sizeof(struct sockaddr_in));
+            continue;
+        }
+
+        pthread_t thread;
+
+        // the context is the argument of the new thread
+        ctx->socket_desc = client_desc;
+
+		ret = pthread_create(&thread, NULL, connection_handler, (void*)ctx);
+		PTHREAD_ERROR_HELPER(ret, "[ACCEPTOR] Cannot create a new thread");
+		
+		ret = pthread_detach(thread);
+		PTHREAD_ERROR_HELPER(ret, "Could not detach the thread");
+		
+        // the handler owns the context now: we need a new one for the next connection
+        ctx = conn_ctx_alloc();
+        if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
+    }
+}
+
+/* In sharded mode each CPU has its own acceptor thread, pinned to it, with
+ * its own SO_REUSEPORT listening socket: the kernel spreads connections
+ * among the sockets, so acceptors never contend on a shared accept queue,
+ * and the handler threads inherit the acceptor's CPU affinity */
+void* shard_acceptor(void* arg) {
+    int cpu = (int)(long)arg;
+
+    int ret = listener_pin_to_cpu(cpu);
+    ERROR_HELPER(ret, "Cannot pin acceptor thread to its CPU");
+
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 1,
+        .rcvbuf       = SOCKET_RCVBUF,
+        .sndbuf       = SOCKET_SNDBUF,
+    };
+    int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+    if (DEBUG) fprintf(stderr, "[ACCEPTOR %d] Listening on its own socket\n", cpu);
+
+    accept_loop(socket_desc);
+    return NULL; // never reached
+}
+
 int main(int argc, char* argv[]) {
     int ret;
 
-    int socket_desc, client_desc;
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--sharded"))) {
+        fprintf(stderr, "Syntax: %s [--sharded]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     /* ===> SOLUTION <=== */
     /** We set up a semaphore to control server's degree of concurrency
@@ -132,6 +257,10 @@ int main(int argc, char* argv[]) {
     ret = sem_init(&connections, 0, MAX_CONCURRENCY);
     ERROR_HELPER(ret, "Cannot create semaphore");
 
+    // per-client and global rate limiting of echoed messages
+    limiter = rate_limiter_create();
+    if (limiter == NULL) ERROR_HELPER(-1, "Cannot create rate limiter");
+
     /** Here we set up a handler for SIGTERM and SIGINT signals: this
      *  will allow the server to cleanup before exiting. */
     struct sigaction action;
@@ -142,70 +271,43 @@ int main(int argc, char* argv[]) {
     ret = sigaction(SIGINT, &action, NULL);
     ERROR_HELPER(ret, "Cannot set up handler for SIGINT");
 
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0};
-
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
-
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
-
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
-
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
-    int reuseaddr_opt = 1;
-    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
-    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
-
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
-
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
-
     // print server boot message
     time_t curr_time;
     time(&curr_time);
     fprintf(stderr, "[MAIN THREAD] Starting server at %s", ctime(&curr_time));
 
-    // we allocate client_addr dynamically and initialize it to zero
-    struct sockaddr_in* client_addr = calloc(1, sizeof(struct sockaddr_in));
-
-    // loop to manage incoming connections spawning handler threads
-    while (1) {
-        // accept incoming connection
-        client_desc = accept(socket_desc, (struct sockaddr*) client_addr, (socklen_t*) &sockaddr_len);
-        if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
-        ERROR_HELPER(client_desc, "[MAIN THREAD] Cannot open socket for incoming connection");
-
-        if (DEBUG) fprintf(stderr, "[MAIN THREAD] Incoming connection accepted\n");
-
-        pthread_t thread;
-
-        // put arguments for the new thread into a buffer
-        handler_args_t* thread_args = malloc(sizeof(handler_args_t));
-        thread_args->socket_desc = client_desc;
-        thread_args->client_addr = client_addr;
-
-        /* ===> SOLUTION <=== */
-        /** We don't want to create more than MAX_CONCURRENCY threads **/
-        ret = sem_wait(&connections);
-        ERROR_HELPER(ret, "Wait on semaphore failed");
+    if (argc == 2) {
+        // one acceptor for each CPU we are allowed to run on
+        cpu_set_t cpus;
+        ret = sched_getaffinity(0, sizeof(cpus), &cpus);
+        ERROR_HELPER(ret, "Cannot get the CPU affinity of the server");
+
+        pthread_t acceptors[CPU_SETSIZE];
+        int num_acceptors = 0;
+        for (long cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &cpus)) continue;
+            ret = pthread_create(&acceptors[num_acceptors++], NULL, shard_acceptor, (void*)cpu);
+            PTHREAD_ERROR_HELPER(ret, "Could not create an acceptor thread");
+        }
 
-		ret = pthread_create(&thread, NULL, connection_handler, (void*)thread_args);
-		PTHREAD_ERROR_HELPER(ret, "[MAIN THREAD] Cannot create a new thread");
-		
-		ret = pthread_detach(thread);
-		PTHREAD_ERROR_HELPER(ret, "Could not detach the thread");
-		
-        // we can't just reset fields: we need a new buffer for client_addr!
-        client_addr = calloc(1, sizeof(struct sockaddr_in));
+        for (int i = 0; i < num_acceptors; i++) {
+            ret = pthread_join(acceptors[i], NULL);
+            PTHREAD_ERROR_HELPER(ret, "Could not join an acceptor thread");
+        }
+    } else {
+        /* Large backlog and TCP Fast Open; TCP_DEFER_ACCEPT stays off, the
+         * client only talks after our banner */
+        listener_opts_t listen_opts = {
+            .backlog      = MAX_CONN_QUEUE,
+            .defer_accept = DEFER_ACCEPT_SECS,
+            .fastopen     = FASTOPEN_QUEUE,
+            .reuseport    = 0,
+            .rcvbuf       = SOCKET_RCVBUF,
+            .sndbuf       = SOCKET_SNDBUF,
+        };
+        int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+        accept_loop(socket_desc);
     }
 
     exit(EXIT_SUCCESS); // this will never be reached
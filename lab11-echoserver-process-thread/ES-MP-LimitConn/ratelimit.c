@@ -0,0 +1,122 @@
+#include "ratelimit.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "common.h" // rate limiting parameters
+
+/** Token-bucket rate limiting for echoed messages.
+ *
+ * Every message must take one token from the global bucket and one
+ * from the bucket of the client's address. A bucket is refilled at
+ * RATE tokens per second up to BURST tokens. When a token is missing,
+ * the message is queued: it reserves its tokens right away (driving
+ * the bucket below zero) and its handler sleeps until the tokens would
+ * have been there. Messages that would wait more than
+ * RATE_LIMIT_MAX_DELAY_MS are shed instead, which bounds the latency
+ * added to admitted messages even when a client keeps flooding us. **/
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void refill(token_bucket_t* b, double rate, double burst, unsigned long now) {
+    b->tokens += (now - b->last_ns) * rate / 1e9;
+    if (b->tokens > burst) b->tokens = burst;
+    b->last_ns = now;
+}
+
+// nanoseconds to wait before the bucket holds a whole token
+static unsigned long time_to_token(token_bucket_t* b, double rate) {
+    return (b->tokens >= 1.0) ? 0 : (unsigned long)((1.0 - b->tokens) * 1e9 / rate);
+}
+
+static token_bucket_t* find_bucket(rate_limiter_t* rl, in_addr_t addr, unsigned long now) {
+    unsigned int i, h = (addr * 2654435761u) % RL_MAX_CLIENTS; // multiplicative hashing
+    for (i = 0; i < RL_MAX_CLIENTS; i++) {
+        client_bucket_t* c = &rl->clients[(h + i) % RL_MAX_CLIENTS];
+        if (c->used && c->addr == addr)
+            return &c->bucket;
+        if (!c->used) {
+            c->used = 1;
+            c->addr = addr;
+            c->bucket.tokens = CLIENT_RATE_BURST;
+            c->bucket.last_ns = now;
+            return &c->bucket;
+        }
+    }
+    return &rl->overflow;
+}
+
+static void lock(rate_limiter_t* rl) {
+    /* A process may die while holding the mutex: a robust mutex then
+     * returns EOWNERDEAD to the next owner instead of deadlocking. */
+    if (pthread_mutex_lock(&rl->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&rl->mutex);
+}
+
+rate_limiter_t* rate_limiter_create() {
+    rate_limiter_t* rl = mmap(NULL, sizeof(rate_limiter_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rl == MAP_FAILED) return NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&rl->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    unsigned long now = now_ns();
+    rl->global.tokens = GLOBAL_RATE_BURST;
+    rl->global.last_ns = now;
+    rl->overflow.tokens = CLIENT_RATE_BURST;
+    rl->overflow.last_ns = now;
+    return rl;
+}
+
+void rate_limiter_destroy(rate_limiter_t* rl) {
+    pthread_mutex_destroy(&rl->mutex);
+    munmap(rl, sizeof(rate_limiter_t));
+}
+
+int rate_limiter_admit(rate_limiter_t* rl, in_addr_t client) {
+    unsigned long now = now_ns();
+
+    lock(rl);
+    token_bucket_t* bucket = find_bucket(rl, client, now);
+    refill(&rl->global, GLOBAL_RATE, GLOBAL_RATE_BURST, now);
+    refill(bucket, CLIENT_RATE, CLIENT_RATE_BURST, now);
+
+    unsigned long wait = time_to_token(&rl->global, GLOBAL_RATE);
+    unsigned long client_wait = time_to_token(bucket, CLIENT_RATE);
+    if (client_wait > wait) wait = client_wait;
+
+    if (wait > RATE_LIMIT_MAX_DELAY_MS * 1000000UL) {
+        rl->rejected++;
+        pthread_mutex_unlock(&rl->mutex);
+        return RL_REJECTED;
+    }
+
+    // reserve our tokens, even if they are not there yet
+    rl->global.tokens -= 1.0;
+    bucket->tokens -= 1.0;
+    if (wait == 0) rl->admitted++;
+    else rl->delayed++;
+    pthread_mutex_unlock(&rl->mutex);
+
+    if (wait == 0) return RL_ADMITTED;
+
+    struct timespec pause = { wait / 1000000000UL, wait % 1000000000UL };
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR) continue;
+    return RL_DELAYED;
+}
+
+void rate_limiter_print_stats(rate_limiter_t* rl, FILE* f) {
+    // approximate snapshot: no lock, since we may be in a signal handler
+    fprintf(f, "Rate limiter: %lu messages admitted, %lu delayed, %lu rejected\n",
+            rl->admitted, rl->delayed, rl->rejected);
+}
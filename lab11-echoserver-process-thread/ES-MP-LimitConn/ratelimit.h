@@ -0,0 +1,43 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <netinet/in.h> // in_addr_t
+
+#define RL_MAX_CLIENTS  256 // client addresses with their own bucket (others share one)
+
+/* Outcome of rate_limiter_admit() */
+#define RL_ADMITTED     0   // a token was available: go on immediately
+#define RL_DELAYED      1   // the caller has been put to sleep until its turn came
+#define RL_REJECTED     2   // the queue is too long: drop the message
+
+typedef struct token_bucket_s {
+    double          tokens;     // may go below zero: tokens reserved by delayed messages
+    unsigned long   last_ns;    // last refill
+} token_bucket_t;
+
+typedef struct client_bucket_s {
+    in_addr_t       addr;
+    int             used;
+    token_bucket_t  bucket;
+} client_bucket_t;
+
+typedef struct rate_limiter_s {
+    pthread_mutex_t mutex;      // process-shared and robust
+    token_bucket_t  global;
+    client_bucket_t clients[RL_MAX_CLIENTS];
+    token_bucket_t  overflow;   // shared by clients not fitting in the table
+    unsigned long   admitted;
+    unsigned long   delayed;
+    unsigned long   rejected;
+} rate_limiter_t;
+
+/* The limiter is allocated in anonymous shared memory, so that it is
+ * shared both by threads and by processes forked after its creation */
+rate_limiter_t* rate_limiter_create();
+void rate_limiter_destroy(rate_limiter_t* rl);
+int rate_limiter_admit(rate_limiter_t* rl, in_addr_t client);
+void rate_limiter_print_stats(rate_limiter_t* rl, FILE* f);
+
+#endif
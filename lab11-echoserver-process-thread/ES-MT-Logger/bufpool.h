@@ -0,0 +1,50 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pool of echo buffers whose sizes are powers of two, from
+ * ECHO_BUF_MIN_SIZE to ECHO_BUF_MAX_SIZE (see common.h). Each size class
+ * keeps a free list; when it runs empty, buffers are carved one at a time
+ * from a slab of BUFPOOL_SLAB_SIZE bytes, so only the pages of buffers
+ * actually handed out get touched. Buffers are never given back to
+ * malloc(), so a connection that grows and shrinks its buffer does not
+ * go through the allocator every time. */
+#define BUFPOOL_SLAB_SIZE   (256 * 1024)
+
+/* Get a buffer of at least size bytes (rounded up to a power of two) from
+ * the pool, or NULL if memory is exhausted. Thread-safe. */
+char* bufpool_get(size_t size);
+
+/* Give back a buffer obtained with bufpool_get(size) */
+void bufpool_put(char* buf, size_t size);
+
+/* Per-connection echo buffer: it at least doubles when a recv() fills
+ * it, since more data is probably waiting, and halves after
+ * ECHO_BUF_SHRINK_AFTER reads in a row that used less than a quarter of
+ * it. Bulk transfers need few syscalls, while idle connections keep a
+ * small buffer. */
+typedef struct echo_buf_s {
+    char*   data;
+    size_t  size;
+    int     small_reads;    // consecutive reads below size / 4
+    char*   spare;          // second buffer for the MSG_ZEROCOPY path (see echo_io.h), or NULL
+    size_t  spare_size;
+    uint32_t spare_done;    // MSG_ZEROCOPY sends to complete before reusing spare
+} echo_buf_t;
+
+/* Returns 0 on success, -1 if no memory is available */
+int echo_buf_init(echo_buf_t* buf);
+
+/* Resize the buffer after echoing a message of received bytes: what
+ * recv() returned, plus what was spliced right behind it, since that
+ * would have filled a larger buffer. The contents are not preserved:
+ * call it once the data has been echoed. */
+void echo_buf_adapt(echo_buf_t* buf, size_t received);
+
+/* Give back both buffers. If they have been sent with MSG_ZEROCOPY, call
+ * zerocopy_flush() first. */
+void echo_buf_release(echo_buf_t* buf);
+
+#endif
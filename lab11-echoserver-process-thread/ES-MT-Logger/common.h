@@ -14,11 +14,37 @@
 
 /* Configuration parameters */
 #define DEBUG           1   // display debug messages
-#define MAX_CONN_QUEUE  3   // max number of connections the server can queue
+#define MAX_CONN_QUEUE  1024    // max number of connections the server can queue
+/* The server speaks first (welcome message), so TCP_DEFER_ACCEPT would
+ * only hold back connections until its timeout: keep it disabled */
+#define DEFER_ACCEPT_SECS   0
+#define FASTOPEN_QUEUE      256 // pending TCP Fast Open requests, 0 disables it
 #define SERVER_ADDRESS  "127.0.0.1"
 #define SERVER_COMMAND  "QUIT"
 #define SERVER_PORT     2015
+/* Pipelined client mode: at most this many messages in flight, so that
+ * what is outstanding always fits in the socket buffers */
+#define PIPELINE_MAX_DEPTH      64
+#define PIPELINE_MAX_MSG_SIZE   1024
 #define LOGFILE         "log.txt"
 #define DEFAULT_BUFFER_SIZE	1024
 
+/* Echoes of at least ZEROCOPY_THRESHOLD bytes are sent with MSG_ZEROCOPY
+ * (0 disables it): below ~10 KB pinning the pages costs more than the copy
+ * it saves. */
+#define ZEROCOPY_THRESHOLD  16384
+
+/* Echo buffers (see bufpool.c): each connection starts with
+ * ECHO_BUF_MIN_SIZE bytes and doubles its buffer, up to ECHO_BUF_MAX_SIZE,
+ * while the client keeps filling it */
+#define ECHO_BUF_MIN_SIZE       DEFAULT_BUFFER_SIZE
+#define ECHO_BUF_MAX_SIZE       65536
+#define ECHO_BUF_SHRINK_AFTER   16  // small reads in a row before halving it
+
+/* Kernel buffers of each connection in bytes (0 keeps the default, which
+ * the kernel tunes automatically). They are set on the listening socket,
+ * so accepted sockets have them from the handshake on. */
+#define SOCKET_RCVBUF   0
+#define SOCKET_SNDBUF   0
+
 #endif
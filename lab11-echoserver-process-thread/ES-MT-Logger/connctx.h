@@ -0,0 +1,37 @@
+#ifndef CONNCTX_H
+#define CONNCTX_H
+
+#include <netinet/in.h> // struct sockaddr_in
+
+#include "bufpool.h"
+#include "echo_io.h"
+
+/* Everything a handler thread needs for one connection, in a single
+ * object: the acceptor fills in the address and the descriptor and hands
+ * the context over to the new thread, which gives it back at the end. */
+typedef struct conn_ctx_s {
+    int                 socket_desc;
+    struct sockaddr_in  client_addr;
+    echo_buf_t          buf;    // kept across connections, at its smallest size
+    zerocopy_t          zc;     // MSG_ZEROCOPY state and counters
+    splice_pipe_t       sp;     // splice() pipe and counters
+} conn_ctx_t;
+
+/* Contexts are carved from slabs and recycled through magazines, small
+ * stacks of free contexts. Every thread takes and returns contexts on its
+ * own magazine without locking, and only trades whole magazines with the
+ * global depot under a mutex: when its magazine runs empty (the acceptor)
+ * or gets full. A handler thread that exits flushes its magazine to the
+ * depot (see cache_flush() in connctx.c). */
+#define CONNCTX_MAGAZINE_SIZE   32
+
+/* Get a context with a zeroed address and an echo buffer of
+ * ECHO_BUF_MIN_SIZE bytes. Returns NULL with errno set if memory is
+ * exhausted. */
+conn_ctx_t* conn_ctx_alloc(void);
+
+/* Give back a context: it can be freed by any thread, not only the one
+ * that allocated it. The descriptor must already be closed. */
+void conn_ctx_free(conn_ctx_t* ctx);
+
+#endif
@@ -2,16 +2,135 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>  // htons() and inet_addr()
 #include <netinet/in.h> // struct sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <sys/socket.h>
 
 #include "common.h"
 
+void send_all(int socket_desc, const char* buf, size_t len) {
+    while (len > 0) {
+        int ret = send(socket_desc, buf, len, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Cannot write to socket");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+double elapsed_us(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+/* Pipelined mode: instead of waiting for each echo before sending the
+ * next message, keep up to 'depth' messages in flight on the connection.
+ * All messages have the same size and start with their sequence number,
+ * so we can cut the echoed stream back into messages and check that they
+ * return complete and in order. How many messages each recv() returns
+ * tells us how much the server coalesces its reads and writes. */
+void pipelined_client(int socket_desc, int depth, unsigned long num_messages, int msg_size) {
+    char msg[PIPELINE_MAX_MSG_SIZE];
+    char buf[PIPELINE_MAX_DEPTH * PIPELINE_MAX_MSG_SIZE];
+    struct timespec sent_at[PIPELINE_MAX_DEPTH]; // indexed by sequence number % depth
+    struct timespec start, now;
+
+    unsigned long sent = 0, received = 0, recv_calls = 0, max_per_recv = 0;
+    size_t buffered = 0;
+    double total_latency = 0, max_latency = 0;
+
+    /* With Nagle's algorithm a small message waits in our socket until the
+     * previous one is acknowledged, and the server may be delaying that ACK:
+     * we would measure these stalls instead of the server's batching */
+    int one = 1;
+    int ret = setsockopt(socket_desc, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ERROR_HELPER(ret, "Cannot set TCP_NODELAY");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (received < num_messages) {
+        // fill the pipeline
+        while (sent < num_messages && sent - received < depth) {
+            int header_len = sprintf(msg, "#%lu ", sent);
+            memset(msg + header_len, '.', msg_size - header_len - 1);
+            msg[msg_size - 1] = '\n';
+            clock_gettime(CLOCK_MONOTONIC, &sent_at[sent % depth]);
+            send_all(socket_desc, msg, msg_size);
+            sent++;
+        }
+
+        // read whatever the server has echoed so far
+        int recv_bytes = recv(socket_desc, buf + buffered, sizeof(buf) - buffered, 0);
+        if (recv_bytes < 0 && errno == EINTR) continue;
+        ERROR_HELPER(recv_bytes, "Cannot read from socket");
+        if (recv_bytes == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        recv_calls++;
+        buffered += recv_bytes;
+
+        // match the complete messages against the ones in flight
+        size_t offset = 0;
+        unsigned long completed = 0;
+        while (buffered - offset >= msg_size) {
+            char* end;
+            unsigned long seq = strtoul(buf + offset + 1, &end, 10);
+            if (buf[offset] != '#' || *end != ' ' || seq != received) {
+                fprintf(stderr, "Unexpected echo: message #%lu is missing or corrupted\n", received);
+                exit(EXIT_FAILURE);
+            }
+            double latency = elapsed_us(&sent_at[seq % depth], &now);
+            total_latency += latency;
+            if (latency > max_latency) max_latency = latency;
+            received++;
+            completed++;
+            offset += msg_size;
+        }
+        if (completed > max_per_recv) max_per_recv = completed;
+
+        // keep the beginning of a message split across two recv()s
+        memmove(buf, buf + offset, buffered - offset);
+        buffered -= offset;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double seconds = elapsed_us(&start, &now) / 1e6;
+    printf("%lu messages of %d bytes, depth %d: %.3f seconds, %.0f messages/s\n",
+           num_messages, msg_size, depth, seconds, num_messages / seconds);
+    printf("latency: mean %.1f us, max %.1f us\n", total_latency / num_messages, max_latency);
+    printf("%lu recv() calls: %.2f messages per recv on average, %lu at most\n",
+           recv_calls, (double) num_messages / recv_calls, max_per_recv);
+
+    // nothing is in flight any more, so the server gets QUIT on its own
+    send_all(socket_desc, SERVER_COMMAND, strlen(SERVER_COMMAND));
+}
+
 int main(int argc, char* argv[]) {
     int ret;
 
+    int depth = 0; // 0: interactive mode
+    unsigned long num_messages = 10000;
+    int msg_size = 64;
+
+    int opt;
+    while ( (opt = getopt(argc, argv, "p:n:s:")) != -1 ) {
+        switch (opt) {
+            case 'p': depth = atoi(optarg); break;
+            case 'n': num_messages = strtoul(optarg, NULL, 10); break;
+            case 's': msg_size = atoi(optarg); break;
+            default:  depth = -1; break;
+        }
+    }
+    if (depth < 0 || depth > PIPELINE_MAX_DEPTH || num_messages == 0 ||
+            msg_size < 32 || msg_size > PIPELINE_MAX_MSG_SIZE || optind != argc) {
+        fprintf(stderr, "Syntax: %s [-p <depth> [-n <messages>] [-s <size>]]\n"
+                "  -p   pipelined mode: keep up to <depth> messages in flight (1-%d)\n"
+                "  -n   messages to send in pipelined mode (default: 10000)\n"
+                "  -s   size of each message in bytes (32-%d, default: 64)\n",
+                argv[0], PIPELINE_MAX_DEPTH, PIPELINE_MAX_MSG_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
     // variables for handling a socket
     int socket_desc;
     struct sockaddr_in server_addr = {0}; // some fields are required to be filled with 0
@@ -47,6 +166,14 @@ int main(int argc, char* argv[]) {
     buf[msg_len] = '\0';
     printf("%s", buf);
 
+    if (depth > 0) {
+        pipelined_client(socket_desc, depth, num_messages, msg_size);
+
+        ret = close(socket_desc);
+        ERROR_HELPER(ret, "Cannot close socket");
+        exit(EXIT_SUCCESS);
+    }
+
     // main loop
     while (1) {
         char* quit_command = SERVER_COMMAND;
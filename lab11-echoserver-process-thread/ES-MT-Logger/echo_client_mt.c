@@ -5,23 +5,148 @@
 #include <unistd.h>
 #include <arpa/inet.h>  // htons() and inet_addr()
 #include <netinet/in.h> // struct sockaddr_in
+#include <sys/epoll.h>
+#include <sys/resource.h> // setrlimit()
 #include <sys/socket.h>
-#include <time.h>       // nanosleep()
+#include <time.h>       // clock_gettime(), clock_nanosleep()
 #include <pthread.h>
 
 #include "common.h"
+#include "performance.h" // latency histogram from lab02
 
-#define THREAD_COUNT    10
-#define SLEEP_TIME      100 // in milliseconds
+/** Load generator for the echo servers of this repository. Each thread
+ *  opens one connection and sends messages on it, one at a time, until the
+ *  test is over; every echoed message gives a latency sample.
+ *
+ *  - closed loop (default): a thread sends its next message as soon as
+ *    the previous one comes back (plus an optional think time), so the
+ *    load adapts to the speed of the server;
+ *  - open loop (-r): messages are sent at a fixed total rate, whatever the
+ *    server does. If the server stalls, the messages that should have left
+ *    meanwhile are late: we measure their latency from the time they were
+ *    *scheduled*, not from when we managed to send them. Otherwise a stall
+ *    would show up as a single slow sample, hiding all the requests that
+ *    waited behind it ("coordinated omission").
+ **/
 
-struct timespec pause_interval; // used by nanosleep()
-int should_stop;
+#define THREAD_COUNT    10  // default number of connections
+#define MSG_SIZE        32  // default message size in bytes
 
-void* connection_handler(void* arg) {
+typedef struct loadgen_config_s {
+    int     connections;
+    double  rate;           // total messages per second (open loop), 0 = closed loop
+    int     think_ms;       // closed loop: pause between a reply and the next message
+    int     min_size, max_size;
+    int     duration;       // seconds, 0 = until ENTER is pressed
+} loadgen_config_t;
+
+typedef struct thread_stats_s {
+    int             thread_idx;
+    unsigned long   messages;       // echoed back
+    unsigned long   rejected;       // answered with a BUSY message (rate limiting)
+    unsigned long   bytes;
+    int             refused;        // connection turned away by the server
+    histogram       latency;        // from the scheduled time in open loop
+    histogram       service_time;   // from the actual send()
+} thread_stats_t;
+
+loadgen_config_t config = {
+    .connections = THREAD_COUNT,
+    .rate        = 0,
+    .think_ms    = 0,
+    .min_size    = MSG_SIZE,
+    .max_size    = MSG_SIZE,
+    .duration    = 10,
+};
+
+volatile int should_stop;
+
+static inline unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long deadline_ns) {
+    struct timespec ts = { deadline_ns / 1000000000UL, deadline_ns % 1000000000UL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Receive exactly len bytes, unless the server answers with a BUSY line:
+ * returns 1 for an echo, 0 for a BUSY reply (which is consumed) */
+static int recv_echo(int socket_desc, char* buf, int len) {
+    int received = 0;
+    while (received < len) {
+        int ret = recv(socket_desc, buf + received, len - received, 0);
+        if (ret == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Cannot read from socket");
+        received += ret;
+
+        // our messages never start with 'B', so this is a busy reply
+        if (buf[0] == 'B') {
+            while (buf[received - 1] != '\n') {
+                // we only need to find its end: once buf is full, start over
+                int offset = received == len ? 0 : received;
+                ret = recv(socket_desc, buf + offset, len - offset, 0);
+                if (ret == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
+                if (ret < 0 && errno == EINTR) continue;
+                ERROR_HELPER(ret, "Cannot read from socket");
+                received = offset + ret;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Prepare the next message of a connection and return its length:
+ * "[Conn N] message #M" padded with dots, so never "QUIT" nor "B..." */
+static int build_message(char* msg, int conn_idx, unsigned long seq, unsigned int* seed) {
+    int msg_len = config.min_size;
+    if (config.max_size > config.min_size)
+        msg_len += rand_r(seed) % (config.max_size - config.min_size + 1);
+
+    int header = snprintf(msg, msg_len, "[Conn %d] message #%lu", conn_idx, seq);
+    if (header > msg_len - 1) header = msg_len - 1;
+    memset(msg + header, '.', msg_len - header - 1);
+    msg[msg_len - 1] = '\n';
+    return msg_len;
+}
+
+/* Account for a completed exchange: in open loop the latency starts from
+ * the time the message was scheduled, in closed loop from the send() */
+static void record_reply(thread_stats_t* stats, int echoed, int msg_len, unsigned long scheduled,
+                         unsigned long sent_at, unsigned long received_at) {
+    if (echoed) {
+        stats->messages++;
+        stats->bytes += msg_len;
+    } else {
+        stats->rejected++;
+    }
+
+    histogram_record(&stats->service_time, received_at - sent_at);
+    histogram_record(&stats->latency, received_at - (config.rate > 0 ? scheduled : sent_at));
+}
 
-    int thread_idx = (int)(long)arg;
+static void send_all(int socket_desc, const char* buf, int len) {
+    int bytes_sent = 0;
+    while (bytes_sent < len) {
+        int ret = send(socket_desc, buf + bytes_sent, len - bytes_sent, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ret, "Cannot write to socket");
+        bytes_sent += ret;
+    }
+}
+
+void* connection_handler(void* arg) {
+    thread_stats_t* stats = (thread_stats_t*) arg;
+    int thread_idx = stats->thread_idx;
     int ret;
 
+    histogram_init(&stats->latency);
+    histogram_init(&stats->service_time);
+
     // variables for handling a socket
     int socket_desc;
     struct sockaddr_in server_addr = {0}; // some fields are required to be filled with 0
@@ -39,105 +164,573 @@ void* connection_handler(void* arg) {
     ret = connect(socket_desc, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in));
     ERROR_HELPER(ret, "Could not create connection");
 
-    char buf[DEFAULT_BUFFER_SIZE];
+    int buf_len = config.max_size > DEFAULT_BUFFER_SIZE ? config.max_size : DEFAULT_BUFFER_SIZE;
+    char* buf = malloc(buf_len);
+    char* msg = malloc(config.max_size);
     int msg_len;
 
     // get welcome message from server
     while ( (msg_len = recv(socket_desc, buf, DEFAULT_BUFFER_SIZE - 1, 0)) <= 0 ) {
         if (msg_len == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
-        
+
         // if we get here we know that ret == -1
         if (errno == EINTR) continue;
         ERROR_HELPER(-1, "Cannot read from socket");
     }
 
-    // main loop
-    int counter = 0;
-    while (1) {
+    // an overloaded server greets us with a busy message and hangs up
+    if (!strncmp(buf, "BUSY", 4)) {
+        stats->refused = 1;
+        close(socket_desc);
+        free(buf);
+        free(msg);
+        return NULL;
+    }
 
-        nanosleep(&pause_interval, NULL);
-
-        char* quit_command = SERVER_COMMAND;
-        size_t quit_command_len = strlen(quit_command);
-
-        if (should_stop)
-            sprintf(buf, "%s", quit_command);
-        else
-            sprintf(buf, "[Thread %d] message #%d", thread_idx, ++counter);
-        msg_len = strlen(buf);
-        buf[msg_len] = '\0'; // remove '\n' from the end of the message
-
-        // send message to server
-        int bytes_sent = 0;
-        while (bytes_sent < msg_len) {
-            ret = send(socket_desc, buf+bytes_sent, msg_len-bytes_sent, 0);
-            if (ret == 1 && errno == EINTR) continue;
-            ERROR_HELPER(ret, "Cannot write to socket");
-            bytes_sent += ret;
-        }
+    /* Open loop: this connection sends one message every interval, and the
+     * connections are staggered so that together they send at config.rate */
+    unsigned long interval = config.rate > 0 ? (unsigned long)(config.connections * 1e9 / config.rate) : 0;
+    unsigned long scheduled = now_ns() + interval * thread_idx / config.connections;
 
-        /* After a quit command we won't receive any more data from
-         * the server, thus we must exit the main loop. */
-        if (msg_len == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
-        
-        // read message from server
-        // (best-effort implementation: we don't have a message delimiter)
-        while ( (msg_len = recv(socket_desc, buf, DEFAULT_BUFFER_SIZE, 0)) <= 0 ) {
-            if (msg_len == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
-            
-            // if we get here we know that ret == -1
-            if (errno == EINTR) continue;
-            ERROR_HELPER(-1, "Cannot read from socket");
-        }
+    unsigned int seed = thread_idx + 1;
+    unsigned long seq = 0;
+    while (!should_stop) {
+        msg_len = build_message(msg, thread_idx, ++seq, &seed);
+
+        if (interval > 0) sleep_until(scheduled);
+
+        unsigned long sent_at = now_ns();
+        send_all(socket_desc, msg, msg_len);
+        int echoed = recv_echo(socket_desc, buf, msg_len);
+        unsigned long received_at = now_ns();
+
+        record_reply(stats, echoed, msg_len, scheduled, sent_at, received_at);
+        if (interval > 0)
+            scheduled += interval; // when the next message should leave, late or not
+        else if (config.think_ms > 0)
+            sleep_until(received_at + config.think_ms * 1000000UL);
     }
 
+    /* After a quit command we won't receive any more data from
+     * the server, thus we can close the connection. */
+    send_all(socket_desc, SERVER_COMMAND, strlen(SERVER_COMMAND));
 
     // close the socket
     ret = close(socket_desc);
     ERROR_HELPER(ret, "Cannot close socket");
 
-    pthread_exit(EXIT_SUCCESS);
+    free(buf);
+    free(msg);
+    return NULL;
+}
+
+/** Event-driven engine (-e <threads>): blocking threads cost a stack and a
+ *  kernel task each, so they do not scale beyond a few thousand
+ *  connections. Here a handful of threads drive many non-blocking
+ *  connections each: every connection is a small state machine, advanced
+ *  whenever epoll reports its socket ready or its timer (next scheduled
+ *  message, think time) expires. Timers live in a per-thread binary heap
+ *  ordered by deadline, so epoll_wait() sleeps exactly until the first one.
+ *
+ *  To reach ~100k connections from one box we also raise RLIMIT_NOFILE and
+ *  spread the connections over several loopback source addresses (-a):
+ *  a source address has only ~28k ephemeral ports towards one server port.
+ **/
+
+#define ENGINE_MAX_EVENTS   256
+#define ENGINE_MAX_WAIT_MS  100 // also how quickly we notice should_stop
+#define CONNECT_BATCH       256 // connection attempts in progress per thread
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+enum conn_state {
+    CONN_CONNECTING,    // non-blocking connect() in progress
+    CONN_WELCOME,       // reading the welcome message
+    CONN_WAITING,       // idle until its timer expires
+    CONN_SENDING,       // message partially sent
+    CONN_RECEIVING,     // waiting for (the rest of) the echo
+    CONN_CLOSED
+};
+
+typedef struct echo_conn_s {
+    int             socket_desc;
+    int             idx;
+    enum conn_state state;
+    uint32_t        events;     // what epoll is watching for this socket
+    int             heap_pos;   // position in the timer heap, -1 if not there
+    int             msg_len, sent, received;
+    char            first;      // first byte of the reply: 'B' for BUSY
+    char            last;       // last byte received so far
+    unsigned long   seq;
+    unsigned long   deadline, scheduled, sent_at;
+    char*           msg;
+} echo_conn_t;
+
+typedef struct engine_s {
+    thread_stats_t  stats;      // must be the first field, see main()
+    int             thread_idx, num_threads;
+    int             epoll_desc;
+    echo_conn_t*    conns;
+    int             num_conns, next_to_open, connecting, open;
+    echo_conn_t**   heap;
+    int             heap_size;
+    unsigned int    seed;
+    char            scratch[DEFAULT_BUFFER_SIZE];
+} engine_t;
+
+int source_addrs = 1; // loopback source addresses to rotate over (-a)
+
+/* Timer heap: the connection with the earliest deadline is heap[0] */
+static void heap_swap(engine_t* e, int i, int j) {
+    echo_conn_t* tmp = e->heap[i];
+    e->heap[i] = e->heap[j];
+    e->heap[j] = tmp;
+    e->heap[i]->heap_pos = i;
+    e->heap[j]->heap_pos = j;
+}
+
+static void heap_push(engine_t* e, echo_conn_t* c) {
+    int i = e->heap_size++;
+    e->heap[i] = c;
+    c->heap_pos = i;
+    while (i > 0 && e->heap[(i - 1) / 2]->deadline > e->heap[i]->deadline) {
+        heap_swap(e, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_remove(engine_t* e, echo_conn_t* c) {
+    int i = c->heap_pos;
+    heap_swap(e, i, --e->heap_size);
+    c->heap_pos = -1;
+    if (i == e->heap_size) return;
+
+    // the element moved into position i may have to go up or down
+    while (i > 0 && e->heap[(i - 1) / 2]->deadline > e->heap[i]->deadline) {
+        heap_swap(e, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < e->heap_size && e->heap[l]->deadline < e->heap[smallest]->deadline) smallest = l;
+        if (r < e->heap_size && e->heap[r]->deadline < e->heap[smallest]->deadline) smallest = r;
+        if (smallest == i) break;
+        heap_swap(e, i, smallest);
+        i = smallest;
+    }
+}
+
+static echo_conn_t* heap_pop(engine_t* e) {
+    echo_conn_t* top = e->heap[0];
+    heap_remove(e, top);
+    return top;
+}
+
+static void conn_watch(engine_t* e, echo_conn_t* c, uint32_t events) {
+    if (c->events == events) return;
+    struct epoll_event event = { .events = events, .data.ptr = c };
+    int ret = epoll_ctl(e->epoll_desc, EPOLL_CTL_MOD, c->socket_desc, &event);
+    ERROR_HELPER(ret, "Cannot update the events of a connection");
+    c->events = events;
+}
+
+static void conn_close(engine_t* e, echo_conn_t* c) {
+    if (c->state == CONN_CONNECTING) e->connecting--;
+    if (c->heap_pos >= 0) heap_remove(e, c);
+    close(c->socket_desc); // also removes it from epoll
+    c->state = CONN_CLOSED;
+    e->open--;
+}
+
+/* Start a non-blocking connection attempt */
+static void conn_open(engine_t* e, echo_conn_t* c) {
+    c->socket_desc = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ERROR_HELPER(c->socket_desc, "Could not create socket");
+
+    if (source_addrs > 1) {
+        /* pick the source address now, but the port only in connect(),
+         * which can then reuse a port already bound towards other peers */
+        int one = 1;
+        setsockopt(c->socket_desc, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+        struct sockaddr_in source = {0};
+        source.sin_family      = AF_INET;
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + c->idx % source_addrs); // 127.0.0.1, .2, ...
+        int ret = bind(c->socket_desc, (struct sockaddr*) &source, sizeof(source));
+        ERROR_HELPER(ret, "Cannot bind the source address");
+    }
+
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_addr.s_addr = inet_addr(SERVER_ADDRESS);
+    server_addr.sin_family      = AF_INET;
+    server_addr.sin_port        = htons(SERVER_PORT);
+
+    int ret = connect(c->socket_desc, (struct sockaddr*) &server_addr, sizeof(server_addr));
+    if (ret < 0 && errno != EINPROGRESS) ERROR_HELPER(-1, "Could not create connection");
+
+    c->state    = CONN_CONNECTING;
+    c->events   = EPOLLOUT; // writable = connection established (or failed)
+    c->heap_pos = -1;
+    c->msg      = malloc(config.max_size);
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+    ret = epoll_ctl(e->epoll_desc, EPOLL_CTL_ADD, c->socket_desc, &event);
+    ERROR_HELPER(ret, "Cannot add a connection to epoll");
+
+    e->connecting++;
+    e->open++;
+}
+
+static void conn_send_quit(engine_t* e, echo_conn_t* c) {
+    /* the connection is idle, so the server has read everything: a short
+     * send() on an empty socket buffer always succeeds at once */
+    send(c->socket_desc, SERVER_COMMAND, strlen(SERVER_COMMAND), MSG_NOSIGNAL);
+    conn_close(e, c);
+}
+
+/* Idle connection: send the next message now, or wait for its time */
+static void conn_next(engine_t* e, echo_conn_t* c, unsigned long now) {
+    if (should_stop) {
+        conn_send_quit(e, c);
+        return;
+    }
+
+    if (c->deadline > now) {
+        c->state = CONN_WAITING;
+        conn_watch(e, c, 0); // errors and hang-ups are still reported
+        heap_push(e, c);
+        return;
+    }
+
+    c->msg_len = build_message(c->msg, c->idx, ++c->seq, &e->seed);
+    c->sent = c->received = 0;
+    c->sent_at = now;
+    c->state = CONN_SENDING;
+}
+
+/* Advance the state machine of a connection as far as it can go without
+ * blocking; events is what epoll reported (0 when a timer expired) */
+static void conn_advance(engine_t* e, echo_conn_t* c, uint32_t events) {
+    int ret;
+
+    if (c->state == CONN_WAITING && (events & (EPOLLERR | EPOLLHUP))) {
+        fprintf(stderr, "[Conn %d] closed by the server\n", c->idx);
+        conn_close(e, c);
+        return;
+    }
+
+    while (1) {
+        switch (c->state) {
+        case CONN_CONNECTING: {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(c->socket_desc, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error) {
+                fprintf(stderr, "[Conn %d] Could not create connection: %s\n", c->idx, strerror(error));
+                conn_close(e, c);
+                return;
+            }
+            e->connecting--;
+            c->state = CONN_WELCOME;
+            c->received = 0;
+            conn_watch(e, c, EPOLLIN);
+            break;
+        }
+
+        case CONN_WELCOME:
+            ret = recv(c->socket_desc, e->scratch, sizeof(e->scratch), 0);
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR) break;
+                conn_close(e, c);
+                return;
+            }
+            if (c->received == 0) c->first = e->scratch[0];
+            c->received += ret;
+            if (e->scratch[ret - 1] != '\n') break; // the welcome message is not over
+
+            // an overloaded server greets us with a busy message and hangs up
+            if (c->first == 'B') {
+                e->stats.refused++;
+                conn_close(e, c);
+                return;
+            }
+
+            // open loop: stagger the connections over one interval
+            if (config.rate > 0) {
+                unsigned long interval = (unsigned long)(config.connections * 1e9 / config.rate);
+                c->scheduled = now_ns() + interval * c->idx / config.connections;
+            } else {
+                c->scheduled = 0;
+            }
+            c->deadline = c->scheduled;
+            conn_next(e, c, now_ns());
+            if (c->state != CONN_SENDING) return;
+            break;
+
+        case CONN_WAITING: // the timer expired
+            conn_next(e, c, now_ns());
+            if (c->state != CONN_SENDING) return;
+            break;
+
+        case CONN_SENDING:
+            ret = send(c->socket_desc, c->msg + c->sent, c->msg_len - c->sent, MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EINTR) break;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    conn_watch(e, c, EPOLLOUT);
+                    return;
+                }
+                conn_close(e, c);
+                return;
+            }
+            c->sent += ret;
+            if (c->sent == c->msg_len) {
+                c->state = CONN_RECEIVING;
+                conn_watch(e, c, EPOLLIN);
+            }
+            break;
+
+        case CONN_RECEIVING: {
+            ret = recv(c->socket_desc, e->scratch, sizeof(e->scratch), 0);
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR) break;
+                fprintf(stderr, "[Conn %d] Connection closed unexpectedly!\n", c->idx);
+                conn_close(e, c);
+                return;
+            }
+            if (c->received == 0) c->first = e->scratch[0];
+            c->received += ret;
+            c->last = e->scratch[ret - 1];
+
+            // done with an echo of the whole message, or a complete BUSY line
+            int busy = (c->first == 'B');
+            if (busy ? c->last != '\n' : c->received < c->msg_len) break;
+
+            unsigned long now = now_ns();
+            record_reply(&e->stats, !busy, c->msg_len, c->scheduled, c->sent_at, now);
+
+            if (config.rate > 0) {
+                c->scheduled += (unsigned long)(config.connections * 1e9 / config.rate);
+                c->deadline = c->scheduled;
+            } else {
+                c->deadline = now + config.think_ms * 1000000UL;
+            }
+            conn_next(e, c, now);
+            if (c->state != CONN_SENDING) return;
+            break;
+        }
+
+        case CONN_CLOSED:
+            return;
+        }
+    }
+}
+
+void* engine_thread(void* arg) {
+    engine_t* e = (engine_t*) arg;
+    histogram_init(&e->stats.latency);
+    histogram_init(&e->stats.service_time);
+
+    e->epoll_desc = epoll_create1(EPOLL_CLOEXEC);
+    ERROR_HELPER(e->epoll_desc, "Cannot create epoll instance");
+
+    // this thread drives connections thread_idx, thread_idx + num_threads, ...
+    e->num_conns = (config.connections - e->thread_idx + e->num_threads - 1) / e->num_threads;
+    e->conns = calloc(e->num_conns, sizeof(echo_conn_t));
+    e->heap = malloc(e->num_conns * sizeof(echo_conn_t*));
+    e->seed = e->thread_idx + 1;
+    for (int i = 0; i < e->num_conns; i++)
+        e->conns[i].idx = e->thread_idx + i * e->num_threads;
+
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    int stopping = 0;
+
+    while (e->next_to_open < e->num_conns || e->open > 0) {
+        // open new connections a batch at a time, not to flood the backlog
+        while (!should_stop && e->next_to_open < e->num_conns && e->connecting < CONNECT_BATCH)
+            conn_open(e, &e->conns[e->next_to_open++]);
+        if (should_stop) e->next_to_open = e->num_conns;
+
+        // once the test is over, idle connections quit right away
+        if (should_stop && !stopping) {
+            stopping = 1;
+            while (e->heap_size > 0) conn_advance(e, heap_pop(e), 0);
+        }
+
+        int timeout = ENGINE_MAX_WAIT_MS;
+        if (e->heap_size > 0) {
+            unsigned long now = now_ns();
+            unsigned long first = e->heap[0]->deadline;
+            int ms = first > now ? (int)((first - now + 999999) / 1000000) : 0;
+            if (ms < timeout) timeout = ms;
+        }
+
+        int ready = epoll_wait(e->epoll_desc, events, ENGINE_MAX_EVENTS, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_HELPER(ready, "Cannot wait for events");
+
+        for (int i = 0; i < ready; i++)
+            conn_advance(e, events[i].data.ptr, events[i].events);
+
+        unsigned long now = now_ns();
+        while (e->heap_size > 0 && e->heap[0]->deadline <= now)
+            conn_advance(e, heap_pop(e), 0);
+    }
+
+    for (int i = 0; i < e->num_conns; i++) free(e->conns[i].msg);
+    free(e->conns);
+    free(e->heap);
+    close(e->epoll_desc);
+    return NULL;
+}
+
+/* Many connections need many descriptors: raise the soft limit as far as
+ * the hard limit allows */
+static void raise_fd_limit(int needed) {
+    struct rlimit limit;
+    int ret = getrlimit(RLIMIT_NOFILE, &limit);
+    ERROR_HELPER(ret, "Cannot get RLIMIT_NOFILE");
+
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        ret = setrlimit(RLIMIT_NOFILE, &limit);
+        ERROR_HELPER(ret, "Cannot raise RLIMIT_NOFILE");
+    }
+    if (limit.rlim_cur < (rlim_t) needed)
+        fprintf(stderr, "[WARNING] Only %lu descriptors available for %d connections\n",
+                (unsigned long) limit.rlim_cur, needed);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Syntax: %s [-c <connections>] [-r <rate> | -t <think ms>] [-s <size>[-<max size>]] [-d <seconds>]\n"
+            "       [-e <threads> [-a <source addresses>]]\n"
+            "  -c   number of connections, one thread each unless -e is given (default: %d)\n"
+            "  -r   open loop: total messages per second over all connections\n"
+            "  -t   closed loop: pause after each reply (default: 0)\n"
+            "  -s   message size in bytes, or a range for uniformly distributed sizes (default: %d)\n"
+            "  -d   test duration in seconds, 0 to stop when ENTER is pressed (default: 10)\n"
+            "  -e   drive all the connections with this many epoll threads\n"
+            "  -a   spread the connections over 127.0.0.1 ... 127.0.0.<n> (with -e)\n",
+            prog, THREAD_COUNT, MSG_SIZE);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char* argv[]) {
+    int ret, i;
+
+    int engine_threads = 0;
+    int opt;
+    while ( (opt = getopt(argc, argv, "c:r:t:s:d:e:a:")) != -1 ) {
+        switch (opt) {
+            case 'c': config.connections = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 't': config.think_ms = atoi(optarg); break;
+            case 's':
+                if (sscanf(optarg, "%d-%d", &config.min_size, &config.max_size) == 1)
+                    config.max_size = config.min_size;
+                break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'e': engine_threads = atoi(optarg); break;
+            case 'a': source_addrs = atoi(optarg); break;
+            default:  usage(argv[0]);
+        }
+    }
+    // messages need room for the header's first byte and the final newline
+    if (optind != argc || config.connections <= 0 || config.rate < 0 || config.think_ms < 0 ||
+            config.duration < 0 || config.min_size < 2 || config.max_size < config.min_size ||
+            engine_threads < 0 || source_addrs < 1 || source_addrs > 254)
+        usage(argv[0]);
+    if (engine_threads > config.connections) engine_threads = config.connections;
 
-    /* nanosleep() takes as first argument a pointer to a timespec
-     * object containing the desired interval. It also takes a pointer
-     * (which can be NULL) to another timespec object where it stores
-     * the remaining time if it gets interrupted by a signal. */
-    pause_interval.tv_sec = 0;
-    pause_interval.tv_nsec = SLEEP_TIME * 1000000; // conversion from milliseconds (10^-3) to nanoseconds (10^-9)
     should_stop = 0;
 
-    int ret, i;
-    char buf[DEFAULT_BUFFER_SIZE];
+    // one thread per connection, or a few threads with many connections each
+    int num_threads = engine_threads > 0 ? engine_threads : config.connections;
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    thread_stats_t** stats = malloc(num_threads * sizeof(thread_stats_t*));
+    engine_t* engines = NULL;
+    thread_stats_t* thread_stats = NULL;
+
+    if (engine_threads > 0) {
+        raise_fd_limit(config.connections + 16);
+        engines = calloc(engine_threads, sizeof(engine_t));
+    } else {
+        thread_stats = calloc(config.connections, sizeof(thread_stats_t));
+    }
 
-    pthread_t *threads = (pthread_t*)malloc(THREAD_COUNT * sizeof(pthread_t));
-    for (i = 0; i < THREAD_COUNT; i++) {
-        /* We pass the value (not the address, otherwise we would have a
-         * race condition!!!) of i by casting it into a void* type */
-        ret = pthread_create(&threads[i], NULL, connection_handler, (void*)(long)i);
+    unsigned long start = now_ns();
+    for (i = 0; i < num_threads; i++) {
+        if (engine_threads > 0) {
+            engines[i].thread_idx  = i;
+            engines[i].num_threads = engine_threads;
+            stats[i] = &engines[i].stats;
+            ret = pthread_create(&threads[i], NULL, engine_thread, &engines[i]);
+        } else {
+            thread_stats[i].thread_idx = i;
+            stats[i] = &thread_stats[i];
+            ret = pthread_create(&threads[i], NULL, connection_handler, &thread_stats[i]);
+        }
         PTHREAD_ERROR_HELPER(ret, "Error creating a new thread");
     }
 
-    printf("There are %d threads running and interacting with the EchoServer every %d milliseconds.\nPress ENTER to stop the threads and exit...", THREAD_COUNT, SLEEP_TIME);
+    if (config.rate > 0)
+        printf("%d connections sending %.0f messages/s in total (open loop)", config.connections, config.rate);
+    else
+        printf("%d connections, each sending its next message %d ms after a reply (closed loop)",
+               config.connections, config.think_ms);
+    printf(", messages of %d-%d bytes", config.min_size, config.max_size);
+    if (engine_threads > 0) printf(", driven by %d epoll threads", engine_threads);
+    printf("\n");
 
-    /* Read a line from stdin
-     *
-     * fgets() reads up to sizeof(buf)-1 bytes and on success
-     * returns the first argument passed to it. */
-    if (fgets(buf, sizeof(buf), stdin) != (char*)buf) {
-        fprintf(stderr, "Error while reading from stdin, exiting...\n");
-        exit(EXIT_FAILURE);
+    if (config.duration > 0) {
+        sleep_until(start + config.duration * 1000000000UL);
+    } else {
+        printf("Press ENTER to stop the threads and exit...");
+        fflush(stdout);
+
+        char buf[DEFAULT_BUFFER_SIZE];
+        if (fgets(buf, sizeof(buf), stdin) != (char*)buf) {
+            fprintf(stderr, "Error while reading from stdin, exiting...\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     /* We set the should_stop flag to notify the threads that they
      * have to complete and then we wait for their termination. */
     should_stop = 1;
 
-    for (i = 0; i < THREAD_COUNT; i++)
+    thread_stats_t total;
+    memset(&total, 0, sizeof(total));
+    histogram_init(&total.latency);
+    histogram_init(&total.service_time);
+
+    int refused = 0;
+    for (i = 0; i < num_threads; i++) {
         pthread_join(threads[i], NULL);
-    free(threads);
+        total.messages += stats[i]->messages;
+        total.rejected += stats[i]->rejected;
+        total.bytes    += stats[i]->bytes;
+        refused        += stats[i]->refused;
+        histogram_merge(&total.latency, &stats[i]->latency);
+        histogram_merge(&total.service_time, &stats[i]->service_time);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%lu messages echoed in %.2f seconds: %.0f messages/s, %.2f MB/s\n",
+           total.messages, seconds, total.messages / seconds, total.bytes / seconds / 1e6);
+    if (total.rejected > 0) printf("%lu messages rejected by the server's rate limiter\n", total.rejected);
+    if (refused > 0) printf("%d connections refused by the server\n", refused);
 
+    histogram_print(stdout, config.rate > 0 ? "latency (from schedule)" : "latency", &total.latency);
+    if (config.rate > 0) histogram_print(stdout, "service time", &total.service_time);
+
+    free(threads);
+    free(stats);
+    free(thread_stats);
+    free(engines);
     exit(EXIT_SUCCESS);
 }
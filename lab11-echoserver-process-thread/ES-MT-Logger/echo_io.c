@@ -0,0 +1,242 @@
+#define _GNU_SOURCE // splice(), pipe2()
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h> // IP_RECVERR
+#include <sys/ioctl.h> // FIONREAD
+#include <sys/socket.h>
+#include <linux/errqueue.h> // struct sock_extended_err
+
+#include "common.h"
+#include "echo_io.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* The banner without the client's address and port: these segments are
+ * built once, at compile time */
+static const char banner_head[] = "Hi! I'm an echo server. You are ";
+static const char banner_port[] = " talking on port ";
+static const char banner_tail[] = ".\nI will send you back whatever you send me. "
+                                  "I will stop if you send me " SERVER_COMMAND " :-)\n";
+
+int sendmsg_all(int socket_desc, struct iovec* iov, int iovcnt, int flags) {
+    struct msghdr msg = {0};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t ret = sendmsg(socket_desc, &msg, flags);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -1;
+
+        // skip what has been sent: whole segments first, then part of one
+        while (msg.msg_iovlen > 0 && ret >= msg.msg_iov->iov_len) {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+int echo_send_banner(int socket_desc, const char* client_ip, uint16_t client_port) {
+    char port[8];
+    int port_len = sprintf(port, "%hu", client_port);
+
+    struct iovec iov[5] = {
+        { (void*) banner_head, sizeof(banner_head) - 1 },
+        { (void*) client_ip,   strlen(client_ip) },
+        { (void*) banner_port, sizeof(banner_port) - 1 },
+        { port,                port_len },
+        { (void*) banner_tail, sizeof(banner_tail) - 1 }
+    };
+    return sendmsg_all(socket_desc, iov, 5, 0);
+}
+
+void zerocopy_init(zerocopy_t* zc, int socket_desc, size_t threshold) {
+    memset(zc, 0, sizeof(zerocopy_t));
+    zc->threshold = threshold;
+
+    int one = 1;
+    if (threshold > 0 && setsockopt(socket_desc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        zc->enabled = 1;
+}
+
+/* Read the completion notifications from the error queue until the first
+ * done sends have been notified. Each notification covers a range
+ * [ee_info, ee_data] of send() calls, numbered from 0 in issue order. */
+static int zerocopy_wait(int socket_desc, zerocopy_t* zc, uint32_t done) {
+    int waited = 0;
+
+    // the counters may wrap around: compare them through a signed difference
+    while ((int32_t)(zc->completed - done) < 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr msg = {0};
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        // reading the error queue never blocks: wait with poll() instead
+        if (recvmsg(socket_desc, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+
+            if (!waited) zc->waits++;
+            waited = 1;
+            struct pollfd pfd = { socket_desc, 0, 0 }; // POLLERR is always reported
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+
+        struct cmsghdr* cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+
+            struct sock_extended_err* err = (struct sock_extended_err*) CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) continue;
+
+            if ((int32_t)(err->ee_data + 1 - zc->completed) > 0) zc->completed = err->ee_data + 1;
+            // e.g. on loopback the data is copied for the receiver anyway
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += err->ee_data - err->ee_info + 1;
+        }
+    }
+    return 0;
+}
+
+int echo_send(int socket_desc, zerocopy_t* zc, const char* buf, size_t len) {
+    if (zc != NULL && zc->enabled && len >= zc->threshold) {
+        while (len > 0) {
+            int ret = send(socket_desc, buf, len, MSG_ZEROCOPY);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0 && errno == ENOBUFS) break; // out of pinned memory: copy the rest
+            if (ret < 0) return -1;
+            zc->issued++;
+            zc->in_flight = 1; // the kernel may still be reading from buf
+            buf += ret;
+            len -= ret;
+        }
+    }
+
+    struct iovec iov = { (void*) buf, len };
+    return len > 0 ? sendmsg_all(socket_desc, &iov, 1, 0) : 0;
+}
+
+int zerocopy_next_buf(int socket_desc, zerocopy_t* zc, echo_buf_t* buf) {
+    if (!zc->in_flight) return 0; // the data has been copied: buf->data can be reused
+    zc->in_flight = 0;
+
+    if (buf->spare == NULL) {
+        buf->spare = bufpool_get(buf->size);
+        buf->spare_size = buf->size;
+        buf->spare_done = zc->completed;
+        // no memory for a second buffer: wait for the first one instead
+        if (buf->spare == NULL) return zerocopy_wait(socket_desc, zc, zc->issued);
+    }
+
+    char* data = buf->data;
+    size_t size = buf->size;
+    uint32_t done = buf->spare_done;
+    buf->data = buf->spare;
+    buf->size = buf->spare_size;
+    buf->spare = data;
+    buf->spare_size = size;
+    buf->spare_done = zc->issued;
+
+    // the notifications are read only if the new buffer may still be in use
+    return zerocopy_wait(socket_desc, zc, done);
+}
+
+int zerocopy_flush(int socket_desc, zerocopy_t* zc) {
+    zc->in_flight = 0;
+    return zerocopy_wait(socket_desc, zc, zc->issued);
+}
+
+void zerocopy_print_stats(const zerocopy_t* zc, FILE* stream) {
+    if (zc->issued == 0) return;
+    fprintf(stream, "[ZEROCOPY] %u sends with MSG_ZEROCOPY, %u completed, %lu copied by the kernel, %lu waits\n",
+            zc->issued, zc->completed, zc->copied, zc->waits);
+}
+
+void splice_init(splice_pipe_t* sp, size_t threshold) {
+    memset(sp, 0, sizeof(splice_pipe_t));
+    sp->threshold = threshold;
+    if (threshold > 0 && pipe2(sp->fds, O_CLOEXEC) == 0) sp->enabled = 1;
+}
+
+int splice_pending(int socket_desc, const splice_pipe_t* sp) {
+    if (!sp->enabled) return 0;
+
+    int available;
+    if (ioctl(socket_desc, FIONREAD, &available) < 0) return -1;
+    return available >= sp->threshold ? available : 0;
+}
+
+int echo_splice(int socket_desc, splice_pipe_t* sp, size_t len) {
+    while (len > 0) {
+        // socket -> pipe: at most what the pipe can hold, the pipe is empty here
+        ssize_t in = splice(socket_desc, NULL, sp->fds[1], NULL, len, SPLICE_F_MOVE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0) return -1;
+        if (in == 0) { // the bytes we were told about have disappeared
+            errno = ECONNRESET;
+            return -1;
+        }
+        len -= in;
+
+        // pipe -> socket: drain the pipe completely
+        while (in > 0) {
+            ssize_t out = splice(sp->fds[0], NULL, socket_desc, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out < 0) return -1;
+            in -= out;
+            sp->spliced += out;
+        }
+    }
+    return 0;
+}
+
+void splice_close(splice_pipe_t* sp) {
+    if (!sp->enabled) return;
+    close(sp->fds[0]);
+    close(sp->fds[1]);
+    sp->enabled = 0;
+}
+
+void splice_print_stats(const splice_pipe_t* sp, FILE* stream) {
+    if (sp->spliced == 0) return;
+    fprintf(stream, "[SPLICE] %lu bytes echoed without entering user space\n", sp->spliced);
+}
+
+int echo_step(int socket_desc, zerocopy_t* zc, splice_pipe_t* sp, echo_buf_t* buf, size_t recv_bytes) {
+    if (echo_send(socket_desc, zc, buf->data, recv_bytes) < 0) return -1;
+
+    /* A recv() that filled the buffer hints at a bulk transfer: what is
+     * already queued behind it, if at least sp->threshold bytes, is
+     * echoed with splice() without copying it into the buffer. The buffer
+     * then grows to the size of the whole burst, so that the next one
+     * takes fewer syscalls and can reach zc->threshold */
+    int pending = 0;
+    if (sp != NULL && recv_bytes == buf->size) {
+        pending = splice_pending(socket_desc, sp);
+        if (pending < 0) return -1;
+        if (pending > 0 && echo_splice(socket_desc, sp, pending) < 0) return -1;
+    }
+
+    // the kernel may still be sending from the buffer: switch to the spare one
+    if (zerocopy_next_buf(socket_desc, zc, buf) < 0) return -1;
+    echo_buf_adapt(buf, recv_bytes + pending);
+    return 0;
+}
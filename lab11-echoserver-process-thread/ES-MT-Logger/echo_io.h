@@ -0,0 +1,102 @@
+#ifndef ECHO_IO_H
+#define ECHO_IO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h> // struct iovec
+
+#include "bufpool.h"
+
+/* Send path of the echo servers. The welcome banner is sent with a single
+ * sendmsg() that gathers its static parts and the client's address from
+ * separate buffers, so nothing is copied into a buffer for each
+ * connection. Large echoes can use MSG_ZEROCOPY: the kernel sends
+ * directly from our buffer, and tells us through the socket's error queue
+ * when it no longer needs it. Rather than waiting for that after every
+ * send, the echo loop alternates between two buffers, so it only waits
+ * when the other one is still being sent. Bulk data can even skip user space
+ * entirely: splice() moves it from the socket to a pipe and from the pipe
+ * back to the socket. */
+
+/* Per-connection state of the MSG_ZEROCOPY path */
+typedef struct zerocopy_s {
+    int             enabled;    // SO_ZEROCOPY was accepted by the socket
+    size_t          threshold;  // smaller messages are copied as usual
+    uint32_t        issued;     // send() calls made with MSG_ZEROCOPY
+    uint32_t        completed;  // ... whose completion has been notified
+    unsigned long   copied;     // completions where the kernel copied anyway
+    unsigned long   waits;      // times the echo loop had to wait for a completion
+    int             in_flight;  // the last echo_send() may still be reading its buffer
+} zerocopy_t;
+
+/* Send all the bytes described by iov (which is modified on the way).
+ * Returns 0 on success, -1 with errno set otherwise. */
+int sendmsg_all(int socket_desc, struct iovec* iov, int iovcnt, int flags);
+
+/* Send the welcome banner for a client at client_ip:client_port */
+int echo_send_banner(int socket_desc, const char* client_ip, uint16_t client_port);
+
+/* Enable MSG_ZEROCOPY on the socket for messages of at least threshold
+ * bytes (0 disables it). If the kernel does not support it, every
+ * message simply takes the usual path. */
+void zerocopy_init(zerocopy_t* zc, int socket_desc, size_t threshold);
+
+/* Send len bytes from buf, with MSG_ZEROCOPY when zc allows it. The call
+ * does not wait for the kernel to be done with buf: if it used
+ * MSG_ZEROCOPY, buf must not be written before zerocopy_next_buf() or
+ * zerocopy_flush(). Returns 0 on success, -1 with errno set otherwise. */
+int echo_send(int socket_desc, zerocopy_t* zc, const char* buf, size_t len);
+
+/* Call it after echoing buf->data with echo_send(), before the next
+ * recv() into buf->data. If the kernel may still be reading buf->data, it
+ * becomes the spare buffer, and the spare one (taken from the pool the
+ * first time) takes its place: the call waits only if the send of the
+ * spare buffer has not completed yet, which is rare since the loop has
+ * made a whole round trip in the meantime. Returns 0 on success, -1 with
+ * errno set otherwise. */
+int zerocopy_next_buf(int socket_desc, zerocopy_t* zc, echo_buf_t* buf);
+
+/* Wait until the kernel is done with every buffer sent with MSG_ZEROCOPY:
+ * call it before closing the socket, which would drop the notifications,
+ * and before giving the buffers back to the pool. */
+int zerocopy_flush(int socket_desc, zerocopy_t* zc);
+
+void zerocopy_print_stats(const zerocopy_t* zc, FILE* stream);
+
+/* Per-connection pipe for the splice() path */
+typedef struct splice_pipe_s {
+    int             enabled;    // the pipe has been created
+    int             fds[2];     // read and write end of the pipe
+    size_t          threshold;  // smaller chunks take the user-space path
+    unsigned long   spliced;    // bytes echoed without entering user space
+} splice_pipe_t;
+
+/* Create the pipe for chunks of at least threshold bytes (0 disables the
+ * splice path, as does a failure to create the pipe) */
+void splice_init(splice_pipe_t* sp, size_t threshold);
+
+/* Call it after a recv() that filled the buffer, which hints at a bulk
+ * transfer: returns how many more bytes are already queued on the socket,
+ * to echo with echo_splice(). It returns 0 when they must take the
+ * user-space path instead: the splice path is disabled, or fewer than
+ * threshold bytes are queued. It never blocks, and asking only after a
+ * full recv() keeps small messages at one recv() and one send(). Returns
+ * -1 with errno set on error. */
+int splice_pending(int socket_desc, const splice_pipe_t* sp);
+
+/* Echo len bytes, already queued on the socket, through the pipe.
+ * Returns 0 on success, -1 with errno set otherwise. */
+int echo_splice(int socket_desc, splice_pipe_t* sp, size_t len);
+
+void splice_close(splice_pipe_t* sp);
+
+void splice_print_stats(const splice_pipe_t* sp, FILE* stream);
+
+/* One round of the echo loop, after a recv() of recv_bytes bytes into
+ * buf->data: echo them, splice the rest of a bulk transfer when sp allows
+ * it (sp may be NULL), switch to the spare buffer if the kernel may still
+ * be reading this one, and resize the buffer for the next recv().
+ * Returns 0 on success, -1 with errno set otherwise. */
+int echo_step(int socket_desc, zerocopy_t* zc, splice_pipe_t* sp, echo_buf_t* buf, size_t recv_bytes);
+
+#endif
@@ -1,9 +1,11 @@
+#define _GNU_SOURCE // CPU affinity macros
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>   // sched_getaffinity()
 #include <time.h>
 #include <semaphore.h>
 #include <unistd.h>
@@ -12,6 +14,9 @@
 #include <sys/socket.h>
 
 #include "common.h"
+#include "connctx.h"
+#include "echo_io.h"
+#include "listener.h"
 
 #define LOG_BUFFER_SIZE 128
 
@@ -34,11 +39,6 @@ int write_index;    // index of the next available slot for writing
 
 int logfile_desc;   // file descriptor for logger thread is opened inside main()
 
-typedef struct handler_args_s {
-    int socket_desc;
-    struct sockaddr_in* client_addr;
-} handler_args_t;
-
 void my_log(const char* msg) {
     // duplicate msg string (adding a line terminator for the log file)
     char *tmp = (char*)malloc(strlen(msg) + 2);
@@ -111,39 +111,34 @@ void* logger(void *args) {
 }
 
 void* connection_handler(void* arg) {
-    handler_args_t* args = (handler_args_t*)arg;
+    conn_ctx_t* ctx = (conn_ctx_t*)arg;
 
     int ret, recv_bytes;
 
-    char buf[DEFAULT_BUFFER_SIZE];
     char log_msg[DEFAULT_BUFFER_SIZE];
-    int msg_len;
 
     char* quit_command = SERVER_COMMAND;
     size_t quit_command_len = strlen(quit_command);
 
     // parse client IP address and port
     char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(args->client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
-    uint16_t client_port = ntohs(args->client_addr->sin_port); // port number is an unsigned short
-
-    // send welcome message
-    sprintf(buf, "Hi! I'm an echo server. You are %s talking on port %hu.\nI will send you back whatever"
-            " you send me. I will stop if you send me %s :-)\n", client_ip, client_port, quit_command);
-    msg_len = strlen(buf);
-    int bytes_sent = 0;
-    while (bytes_sent < msg_len) {
-        ret = send(args->socket_desc, buf+bytes_sent, msg_len-bytes_sent, 0);
-        if (ret == 1 && errno == EINTR) continue;
-        ERROR_HELPER(ret, "Cannot write to socket");
-        bytes_sent += ret;
-    }
+    inet_ntop(AF_INET, &(ctx->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+    uint16_t client_port = ntohs(ctx->client_addr.sin_port); // port number is an unsigned short
+
+    /* send welcome message: a single sendmsg() gathers the static parts of
+     * the banner and the client's address (see echo_io.c) */
+    ret = echo_send_banner(ctx->socket_desc, client_ip, client_port);
+    ERROR_HELPER(ret, "Cannot write to socket");
+
+    // large echoes are sent with MSG_ZEROCOPY, if enabled in common.h
+    zerocopy_init(&ctx->zc, ctx->socket_desc, ZEROCOPY_THRESHOLD);
 
     // echo loop
     while (1) {
         // read message from client
         // (best-effort implementation: we don't have a message delimiter)
-        while ( (recv_bytes = recv(args->socket_desc, buf, DEFAULT_BUFFER_SIZE, 0)) <= 0 ) {
+        // (leave room for the '\0' we add before logging the message)
+        while ( (recv_bytes = recv(ctx->socket_desc, ctx->buf.data, ctx->buf.size - 1, 0)) <= 0 ) {
             if (recv_bytes == 0) ERROR_HELPER(-1, "Connection closed unexpectedly!");
             
             // if we get here we know that ret == -1
@@ -152,66 +147,107 @@ void* connection_handler(void* arg) {
         }
 
         // record log message
-        buf[recv_bytes] = '\0';
-        snprintf(log_msg, sizeof(log_msg), "Message received from client %s:%hu: %s", client_ip, client_port, buf);
+        ctx->buf.data[recv_bytes] = '\0';
+        snprintf(log_msg, sizeof(log_msg), "Message received from client %s:%hu: %s", client_ip, client_port, ctx->buf.data);
         my_log(log_msg);
 
         // check whether I have just been told to quit...
-        if (recv_bytes == quit_command_len && !memcmp(buf, quit_command, quit_command_len)) break;
+        if (recv_bytes == quit_command_len && !memcmp(ctx->buf.data, quit_command, quit_command_len)) break;
 
         // ... or if I have to send the message back
-        bytes_sent = 0;
-        while (bytes_sent < recv_bytes) {
-            ret = send(args->socket_desc, buf+bytes_sent, recv_bytes-bytes_sent, 0);
-            if (ret == 1 && errno == EINTR) continue;
-            ERROR_HELPER(ret, "Cannot write to socket");
-            bytes_sent += ret;
-        }
+        // no splice path here: every message goes through the logger
+        ret = echo_step(ctx->socket_desc, &ctx->zc, NULL, &ctx->buf, recv_bytes);
+        ERROR_HELPER(ret, "Cannot write to socket");
     }
 
+    // wait for the MSG_ZEROCOPY sends before closing the socket and releasing the buffers
+    ret = zerocopy_flush(ctx->socket_desc, &ctx->zc);
+    ERROR_HELPER(ret, "Cannot write to socket");
+    if (DEBUG) zerocopy_print_stats(&ctx->zc, stderr);
+
     // close socket
-    ret = close(args->socket_desc);
+    ret = close(ctx->socket_desc);
     ERROR_HELPER(ret, "Cannot close socket for incoming connection");
 
     sprintf(log_msg, "Thread created to handle the client %s:%hu has completed", client_ip, client_port);
     my_log(log_msg);
 
-    free(args->client_addr); // do not forget to free this buffer!
-    free(args);
+    conn_ctx_free(ctx); // back to this thread's cache (see connctx.c)
     pthread_exit(NULL);
 }
 
-int main(int argc, char* argv[]) {
-    int ret;
+/* Accept loop: the whole server runs one of these, or one per CPU in
+ * sharded mode (see shard_acceptor() below) */
+void accept_loop(int socket_desc) {
+    int ret, client_desc;
+    pthread_t thread;
 
-    int socket_desc, client_desc;
+    /* each connection gets a context from the slab (see connctx.c) with its
+     * address, descriptor, buffers and stats, all in a single object */
+    conn_ctx_t* ctx = conn_ctx_alloc();
+    if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
 
-    // some fields are required to be filled with 0
-    struct sockaddr_in server_addr = {0};
+    // loop to manage incoming connections spawning handler threads
+    while (1) {
+        // accept incoming connection
+        client_desc = listener_accept(socket_desc, &ctx->client_addr, SOCK_CLOEXEC);
+        if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
+        ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
+
+        my_log("Incoming connection accepted");
+
+        // the context is the argument of the new thread
+        ctx->socket_desc = client_desc;
 
-    int sockaddr_len = sizeof(struct sockaddr_in); // we will reuse it for accept()
+        ret = pthread_create(&thread, NULL, connection_handler, (void*)ctx);
+		PTHREAD_ERROR_HELPER(ret, "[MAIN THREAD] Cannot create a new thread");
+
+        my_log("New thread created to handle the request");
+
+        pthread_detach(thread); // I won't phtread_join() on this thread
+		PTHREAD_ERROR_HELPER(ret, "Could not detach the thread"); 
 
-    // initialize socket for listening
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    ERROR_HELPER(socket_desc, "Could not create socket");
+        // the handler owns the context now: we need a new one for the next connection
+        ctx = conn_ctx_alloc();
+        if (ctx == NULL) ERROR_HELPER(-1, "Cannot allocate a connection context");
+    }
+}
 
-    server_addr.sin_addr.s_addr = INADDR_ANY; // we want to accept connections from any interface
-    server_addr.sin_family      = AF_INET;
-    server_addr.sin_port        = htons(SERVER_PORT); // don't forget about network byte order!
+/* In sharded mode each CPU has its own acceptor thread, pinned to it, with
+ * its own SO_REUSEPORT listening socket: the kernel spreads connections
+ * among the sockets, so acceptors never contend on a shared accept queue,
+ * and the handler threads inherit the acceptor's CPU affinity */
+void* shard_acceptor(void* arg) {
+    int cpu = (int)(long)arg;
+
+    int ret = listener_pin_to_cpu(cpu);
+    ERROR_HELPER(ret, "Cannot pin acceptor thread to its CPU");
+
+    listener_opts_t listen_opts = {
+        .backlog      = MAX_CONN_QUEUE,
+        .defer_accept = DEFER_ACCEPT_SECS,
+        .fastopen     = FASTOPEN_QUEUE,
+        .reuseport    = 1,
+        .rcvbuf       = SOCKET_RCVBUF,
+        .sndbuf       = SOCKET_SNDBUF,
+    };
+    int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+    char log_msg[64];
+    sprintf(log_msg, "Acceptor for CPU %d is listening", cpu);
+    my_log(log_msg);
 
-    /* We enable SO_REUSEADDR to quickly restart our server after a crash:
-     * for more details, read about the TIME_WAIT state in the TCP protocol */
-    int reuseaddr_opt = 1;
-    ret = setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt, sizeof(reuseaddr_opt));
-    ERROR_HELPER(ret, "Cannot set SO_REUSEADDR option");
+    accept_loop(socket_desc);
+    return NULL; // never reached
+}
 
-    // bind address to socket
-    ret = bind(socket_desc, (struct sockaddr*) &server_addr, sockaddr_len);
-    ERROR_HELPER(ret, "Cannot bind address to socket");
+int main(int argc, char* argv[]) {
+    int ret;
 
-    // start listening
-    ret = listen(socket_desc, MAX_CONN_QUEUE);
-    ERROR_HELPER(ret, "Cannot listen on socket");
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--sharded"))) {
+        fprintf(stderr, "Syntax: %s [--sharded]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     /** [SOLUTION]
      * initialize read and write indexes
@@ -244,33 +280,38 @@ int main(int argc, char* argv[]) {
     pthread_detach(thread);
 	PTHREAD_ERROR_HELPER(ret, "Could not detach the thread");
 	
-    // we allocate client_addr dynamically and initialize it to zero
-    struct sockaddr_in* client_addr = calloc(1, sizeof(struct sockaddr_in));
-
-    // loop to manage incoming connections spawning handler threads
-    while (1) {
-        // accept incoming connection
-        client_desc = accept(socket_desc, (struct sockaddr*) client_addr, (socklen_t*) &sockaddr_len);
-        if (client_desc == -1 && errno == EINTR) continue; // check for interruption by signals
-        ERROR_HELPER(client_desc, "Cannot open socket for incoming connection");
-
-        my_log("Incoming connection accepted");
-
-        // put arguments for the new thread into a buffer
-        handler_args_t* thread_args = malloc(sizeof(handler_args_t));
-        thread_args->socket_desc = client_desc;
-        thread_args->client_addr = client_addr;
-
-        ret = pthread_create(&thread, NULL, connection_handler, (void*)thread_args);
-		PTHREAD_ERROR_HELPER(ret, "[MAIN THREAD] Cannot create a new thread");
-
-        my_log("New thread created to handle the request");
-
-        pthread_detach(thread); // I won't phtread_join() on this thread
-		PTHREAD_ERROR_HELPER(ret, "Could not detach the thread"); 
+    if (argc == 2) {
+        // one acceptor for each CPU we are allowed to run on
+        cpu_set_t cpus;
+        ret = sched_getaffinity(0, sizeof(cpus), &cpus);
+        ERROR_HELPER(ret, "Cannot get the CPU affinity of the server");
+
+        pthread_t acceptors[CPU_SETSIZE];
+        int num_acceptors = 0;
+        for (long cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &cpus)) continue;
+            ret = pthread_create(&acceptors[num_acceptors++], NULL, shard_acceptor, (void*)cpu);
+            PTHREAD_ERROR_HELPER(ret, "Could not create an acceptor thread");
+        }
 
-        // we can't just reset fields: we need a new buffer for client_addr!
-        client_addr = calloc(1, sizeof(struct sockaddr_in));
+        for (int i = 0; i < num_acceptors; i++) {
+            ret = pthread_join(acceptors[i], NULL);
+            PTHREAD_ERROR_HELPER(ret, "Could not join an acceptor thread");
+        }
+    } else {
+        /* Large backlog and TCP Fast Open (see listener.c). No
+         * TCP_DEFER_ACCEPT: the client waits for the banner first */
+        listener_opts_t listen_opts = {
+            .backlog      = MAX_CONN_QUEUE,
+            .defer_accept = DEFER_ACCEPT_SECS,
+            .fastopen     = FASTOPEN_QUEUE,
+            .reuseport    = 0,
+            .rcvbuf       = SOCKET_RCVBUF,
+            .sndbuf       = SOCKET_SNDBUF,
+        };
+        int socket_desc = listener_open(SERVER_PORT, &listen_opts);
+
+        accept_loop(socket_desc);
     }
 
     exit(EXIT_SUCCESS); // this will never be executed